@@ -1,112 +1,365 @@
 #pragma once
 #include "pbbs-include/list_allocator.h"
 #include "defs.h"
+#include "node_policy.h"
 
 // Definitions in this file are independent of balance criteria beyond
-// maintaining an abstract "rank"
+// maintaining an abstract "rank".  The balancing scheme is supplied as
+// the Balance template, e.g. avl_tree or treap_tree (avl.h), or
+// wb_tree (wb.h).
 template<class Node>
 class avl_tree;
 
-template<class Node>
-using tree_interface = avl_tree<Node>;
+// The fields of a node come in layers, each deriving from the one
+// before: the entry and children, then the rank, augmented value,
+// subtree size and reference count, each only if the node keeps it (see
+// node_policy.h).  A layer that is off adds no field, and each layer
+// packs into the tail padding of the ones before, so e.g. the counts of
+// a node with an int key and no value go in the bytes after is_block.
+// Each layer also has the accessors for its field that the code common
+// to all nodes goes through.
+template<class Node, class K, class V>
+struct node_entry {
+    node_entry() : is_block(false) {}
+
+    // ordering is designed to save space
+    union {
+      Node* lc;     // left child
+      void* block;  // entries of a leaf block
+    };
+    Node* rc;  // right child (NULL for a leaf block)
+    K key;
+    V value;
+    bool is_block; // entries are stored in the block above
+};
+
+template<class Base, bool keep>
+struct node_rank_field : Base {
+    unsigned char rank; // safe as a height, but not a weight
+    tree_size_t get_rank_val() const { return rank; }
+    void set_rank_val(tree_size_t r) { rank = r; }
+};
+
+template<class Base>
+struct node_rank_field<Base, false> : Base {
+    tree_size_t get_rank_val() const { return 0; }
+    void set_rank_val(tree_size_t) {}
+};
+
+template<class Base, class AugmOp, bool keep>
+struct node_aug_field : Base {
+    typename AugmOp::aug_t aug_val; // augmented value
+    const typename AugmOp::aug_t get_aug_val() const { return aug_val; }
+    void set_aug_val(const typename AugmOp::aug_t& a) { aug_val = a; }
+};
+
+template<class Base, class AugmOp>
+struct node_aug_field<Base, AugmOp, false> : Base {
+    const typename AugmOp::aug_t get_aug_val() const {
+      return AugmOp::get_empty(); }
+    void set_aug_val(const typename AugmOp::aug_t&) {}
+};
+
+template<class Base, bool keep>
+struct node_count_field : Base {
+    tree_size_t node_cnt; // subtree size, or entries of a leaf block
+    size_t block_size() const { return node_cnt; }
+    void set_node_cnt(size_t n) { node_cnt = n; }
+    template<class T>
+    void update_node_cnt(const T* l, const T* r) {
+      node_cnt = 1 + (l ? l->node_cnt : 0) + (r ? r->node_cnt : 0); }
+    size_t size_hint() const { return node_cnt; }
+};
+
+// Without sizes there are no leaf blocks, and the sizes for granularity
+// are those of complete trees of the same height.  AVL trees are at most
+// about 1.44 times as tall as those, so this is off by a small power of
+// the actual size at worst.
+template<class Base>
+struct node_count_field<Base, false> : Base {
+    size_t block_size() const { return 0; }
+    void set_node_cnt(size_t) {}
+    template<class T>
+    void update_node_cnt(const T*, const T*) {}
+    size_t size_hint() const {
+      tree_size_t h = this->get_rank_val();
+      return ((size_t) 1) << std::min<tree_size_t>(h, 63);
+    }
+};
+
+// Nodes without reference counts belong to one map only.
+template<class Base, bool keep>
+struct node_ref_field : Base {
+    node_ref_field() : ref_cnt(1) {}
+
+    tree_size_t ref_cnt; // reference count
+
+    // A count of one means the caller holds the only reference, so no
+    // other thread can touch the count and uniquely owned nodes (the
+    // common case when building or updating a map that is not shared)
+    // are freed without a read-modify-write.  The load is still atomic
+    // (acquire) so that it pairs with the decrement of a thread that
+    // dropped a reference before.  True if this was the last reference.
+    bool release() {
+      return (__atomic_load_n(&ref_cnt, __ATOMIC_ACQUIRE) == 1 ||
+	      pbbs::fetch_and_add(&ref_cnt, -1) == 1);
+    }
+    void retain() { pbbs::write_add(&ref_cnt, 1); }
+    bool is_shared() const { return ref_cnt > 1; }
+};
 
-template<class K, class V, class AugmOp, class Compare>
-class node {
+template<class Base>
+struct node_ref_field<Base, false> : Base {
+    bool release() { return true; }
+    bool is_shared() const { return false; }
+};
+
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance = avl_tree,
+         class Policy = default_node_policy>
+class node;
+
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+using node_fields =
+  node_ref_field<
+    node_count_field<
+      node_aug_field<
+        node_rank_field<
+          node_entry<node<K, V, AugmOp, Compare, Balance, Policy>, K, V>,
+          Balance<node<K, V, AugmOp, Compare, Balance, Policy> >::uses_rank>,
+        AugmOp, Policy::augmentation && keeps_aug<AugmOp>::value>,
+      Policy::order_statistics>,
+    Policy::persistence>;
+
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+class node : public node_fields<K, V, AugmOp, Compare, Balance, Policy> {
 public:
     using key_type    = K ;
     using value_type  = V ;
     using key_compare = Compare;
     using entry_type  = std::pair<K, V>;
-    using node_type   = node<K, V, AugmOp, Compare>;    
+    using node_type   = node<K, V, AugmOp, Compare, Balance, Policy>;    
     using allocator   = list_allocator<node_type>;
-    using tree_type   = tree_interface<node_type>;
+    using arena       = typename allocator::arena;
+    using tree_type   = Balance<node_type>;
     using aug_type    = typename AugmOp::aug_t;
     using aug_class   = AugmOp;
+    using block_type  = typename Policy::template block<K, V, Compare>;
+    using block_iterator = typename block_type::iterator;
 
     node(const entry_type&, node_type* lc, node_type* rc, bool do_update = 1);
     node(const entry_type&);
-    node() : ref_cnt(1) {};
+    node() {};
 
-    const entry_type get_entry() const { return entry_type(key,value); }
-    const K& get_key() const { return key; }
-    const V& get_value() const { return value; }
+    const entry_type get_entry() const { return entry_type(this->key,this->value); }
+    const K& get_key() const { return this->key; }
+    const V& get_value() const { return this->value; }
         
-    void set_value(const V _value) { value = _value; }
-    void set_entry(const entry_type kv) { key = kv.first; value = kv.second;}
+    void set_value(const V _value) { this->value = _value; }
+    void set_entry(const entry_type kv) { this->key = kv.first; this->value = kv.second;}
             
-    const aug_type get_aug_val() const { return aug_val; }
+    // Which optional parts of a node are kept: augmented values unless
+    // the policy turns them off or the augmentation carries no
+    // information (see keeps_aug), ranks only for balance schemes that
+    // use them, and sizes and reference counts as the policy says.
+    // Those not kept have no field.
+    static constexpr bool has_aug = Policy::augmentation && keeps_aug<AugmOp>::value;
+    static constexpr bool has_rank = tree_type::uses_rank;
+    static constexpr bool has_count = Policy::order_statistics;
+    static constexpr bool has_refs = Policy::persistence;
+
+    static_assert(has_count || has_rank,
+		  "nodes without sizes need a balance scheme with ranks");
+
     static void* operator new(size_t size) { return allocator::alloc(); }
+    // in arena a, or the default pool if NULL
+    static void* operator new(size_t size, arena* a) {
+      return allocator::alloc(a); }
 
+    // in the same arena as this node, as are the nodes expose() makes
     inline node_type* copy();
     inline void update();
     inline void collect();
 
-    // ordering is designed to save space
-    node_type* lc;  // left child
-    node_type* rc;  // right child
-    K key;
-    V value;
-    aug_type aug_val; // augmented value
-    unsigned char rank; // safe as a height, but not a weight
-    tree_size_t node_cnt; // subtree size
-    tree_size_t ref_cnt; // reference count
+    // Leaf blocks: a childless node storing node_cnt sorted entries in a
+    // flat block (see leaf_block.h), with key set to the smallest key.
+    // Its rank is that of the balanced tree it stands for, so balancing
+    // code can treat it as an ordinary subtree.  The entries of a block
+    // standing for an evicted subtree are in a page_store instead, and
+    // it keeps the rank and augmented value of that subtree.
+    static node_type* make_block(const entry_type* A, size_t n, arena* a);
+    static node_type* init_block(node_type* t, const entry_type* A, size_t n);
+    static tree_size_t block_rank(size_t n);
+    block_iterator block_begin() const {
+      return block_type::begin(this->block, this->block_size(), this->key); }
+    node_type* expose();
+};
+
+// The entries of a leaf block as an array, decoded into a temporary
+// buffer if the block is encoded
+template<class Node>
+struct block_array {
+  using E = typename Node::entry_type;
+  const E* A;
+  E* buf;
+  size_t n;
+
+  block_array(const Node* b) : buf(NULL), n(b->block_size()) {
+    A = Node::block_type::array(b->block);
+    if (A == NULL) {
+      buf = pbbs::new_array_no_init<E>(n);
+      typename Node::block_iterator it = b->block_begin();
+      for (size_t i = 0; i < n; i++, ++it)
+        pbbs::assign_uninitialized(buf[i], *it);
+      A = buf;
+    }
+  }
+  ~block_array() { if (buf) pbbs::delete_array(buf, n); }
+  const E& operator [] (size_t i) const { return A[i]; }
 };
 
-template<class K, class V, class AugmOp, class Compare>
-inline tree_size_t get_rank(const node<K, V, AugmOp, Compare>* t) {
-  return t ? t->rank : 0;
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+inline tree_size_t
+get_rank(const node<K, V, AugmOp, Compare, Balance, Policy>* t) {
+  return t ? t->get_rank_val() : 0;
 }
 
-template<class K, class V, class AugmOp, class Compare>
-typename AugmOp::aug_t get_aug(const node<K, V, AugmOp, Compare>* t) {
-  return t ? t->aug_val : AugmOp::get_empty();
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+typename AugmOp::aug_t
+get_aug(const node<K, V, AugmOp, Compare, Balance, Policy>* t) {
+  static_assert(Policy::augmentation,
+		"aug queries need nodes with augmentation (see node_policy.h)");
+  return t ? t->get_aug_val() : AugmOp::get_empty();
 }
 
-template<class K, class V, class AugmOp, class Compare>
-inline void node<K, V, AugmOp, Compare>::collect() {
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+inline void node<K, V, AugmOp, Compare, Balance, Policy>::collect() {
+    if (this->is_block) block_type::destroy(this->block, this->block_size());
     get_key().~key_type();
     get_value().~value_type();
     allocator::free(this);
 }
 
-template<class K, class V, class AugmOp, class Compare>
-inline node<K, V, AugmOp, Compare>* node<K, V, AugmOp, Compare>::copy() {
-    node_type* ret = new node_type(get_entry(), lc, rc, 0);
-    ret->rank = rank;
-    ret->aug_val = aug_val;
-    increase(lc);
-    increase(rc);
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+inline node<K, V, AugmOp, Compare, Balance, Policy>*
+node<K, V, AugmOp, Compare, Balance, Policy>::copy() {
+    arena* a = allocator::arena_of(this);
+    if (this->is_block)
+      return make_block(block_array<node_type>(this).A, this->block_size(), a);
+    node_type* ret = new (a) node_type(get_entry(), this->lc, this->rc, 0);
+    ret->set_rank_val(this->get_rank_val());
+    ret->set_aug_val(this->get_aug_val());
+    increase(this->lc);
+    increase(this->rc);
     return ret;
 }
 
-template<class K, class V, class AugmOp, class Compare>
-inline void node<K, V, AugmOp, Compare>::update() {
-    aug_val = AugmOp::from_entry(get_key(), get_value());
-    //if (lc) aug_val = AugmOp::combine(aug_val, lc->aug_val);
-	if (lc) aug_val = AugmOp::combine(lc->aug_val, aug_val);
-    if (rc) aug_val = AugmOp::combine(aug_val, rc->aug_val);
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+inline void node<K, V, AugmOp, Compare, Balance, Policy>::update() {
+    if (this->is_block) {
+      size_t n = this->block_size();
+      if (has_aug) {
+        block_iterator it = block_begin();
+        aug_type a = AugmOp::from_entry(it.key(), it.value());
+        for (size_t i = 1; i < n; i++) {
+          ++it;
+          a = AugmOp::combine(a, AugmOp::from_entry(it.key(), it.value()));
+        }
+        this->set_aug_val(a);
+      }
+      if (has_rank) this->set_rank_val(block_rank(n));
+      return;
+    }
+    node_type* l = this->lc;
+    node_type* r = this->rc;
+    if (has_aug) {
+      aug_type a = AugmOp::from_entry(get_key(), get_value());
+      if (l) a = AugmOp::combine(l->get_aug_val(), a);
+      if (r) a = AugmOp::combine(a, r->get_aug_val());
+      this->set_aug_val(a);
+    }
 
-    rank = tree_type::combine_ranks(get_rank(lc), get_rank(rc));
-    node_cnt = 1 + get_node_count(lc) + get_node_count(rc);
+    if (has_rank)
+      this->set_rank_val(tree_type::combine_ranks(get_rank(l), get_rank(r)));
+    this->update_node_cnt(l, r);
 }
 
-template<class K, class V, class AugmOp, class Compare>
-    node<K, V, AugmOp, Compare>::node(const entry_type& kv, node_type* left, node_type* right,
-                 bool do_update) {
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+node<K, V, AugmOp, Compare, Balance, Policy>::node(const entry_type& kv, node_type* left,
+                                                   node_type* right, bool do_update) {
     set_entry(kv);
-    ref_cnt = 1;
-    lc = left;
-    rc = right;
+    this->lc = left;
+    this->rc = right;
     if (do_update) update();
 }
 
-template<class K, class V, class AugmOp, class Compare>
-    node<K, V, AugmOp, Compare>::node(const entry_type& kv) {
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+node<K, V, AugmOp, Compare, Balance, Policy>::node(const entry_type& kv) {
     set_entry(kv);
-    ref_cnt = 1;
-    lc = rc = NULL;
-    aug_val = AugmOp::from_entry(get_key(),get_value());
-    rank = tree_type::singleton_rank();
-    node_cnt = 1;
+    this->lc = this->rc = NULL;
+    if (has_aug) this->set_aug_val(AugmOp::from_entry(get_key(),get_value()));
+    if (has_rank) this->set_rank_val(tree_type::singleton_rank());
+    this->set_node_cnt(1);
+}
+
+
+// Returns NULL if empty, a single node for one entry, and a leaf block
+// holding a copy of the entries otherwise, allocated in arena a (see
+// list_allocator).  A must be sorted.
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+node<K, V, AugmOp, Compare, Balance, Policy>*
+node<K, V, AugmOp, Compare, Balance, Policy>::make_block(const entry_type* A, size_t n, arena* a) {
+    if (n == 0) return NULL;
+    if (n == 1) return new (a) node_type(A[0]);
+    return init_block(new (a) node_type(), A, n);
 }
 
+// Makes the default constructed node t a leaf block of n > 1 entries.
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+node<K, V, AugmOp, Compare, Balance, Policy>*
+node<K, V, AugmOp, Compare, Balance, Policy>::init_block(node_type* t, const entry_type* A, size_t n) {
+    t->block = block_type::create(A, n);
+    t->key = A[0].first;
+    t->rc = NULL;
+    t->is_block = true;
+    t->set_node_cnt(n);
+    t->update();
+    return t;
+}
+
+// rank of the tree t_from_sorted_array would build on n entries
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+tree_size_t
+node<K, V, AugmOp, Compare, Balance, Policy>::block_rank(size_t n) {
+    if (n == 0) return 0;
+    if (n == 1) return tree_type::singleton_rank();
+    return tree_type::combine_ranks(block_rank(n/2), block_rank(n-n/2-1));
+}
+
+// Splits a leaf block at its middle entry into a regular node with
+// (possibly block) children.  Consumes the caller's reference.
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
+node<K, V, AugmOp, Compare, Balance, Policy>*
+node<K, V, AugmOp, Compare, Balance, Policy>::expose() {
+    size_t n = this->block_size(), mid = n/2;
+    block_array<node_type> B(this);
+    arena* a = allocator::arena_of(this);
+    node_type* ret = new (a) node_type(B[mid],
+                                       make_block(B.A, mid, a),
+                                       make_block(B.A+mid+1, n-mid-1, a));
+    decrease(this);
+    return ret;
+}
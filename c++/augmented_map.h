@@ -1,6 +1,9 @@
 #pragma once
 
 #include "tree_operations.h"
+#include "tree_cursor.h"
+#include "map_file.h"
+#include "wb.h"
 #include <vector>
 #include "types.h"
 #include <typeinfo>
@@ -10,15 +13,21 @@
 
 using namespace std;
 
-template<class K, class V, class AugmOp, class Compare>
+template<class K, class V, class AugmOp, class Compare,
+         template<class> class Balance, class Policy>
 class augmented_map;
 
-template<class K, class V, class Compare = std::less<K> >
-using tree_map = augmented_map<K, V, noop<K,V>, Compare>;
+template<class K, class V, class Compare = std::less<K>,
+         template<class> class Balance = avl_tree>
+using tree_map = augmented_map<K, V, noop<K,V>, Compare, Balance,
+                               default_node_policy>;
 
 template<class K>
 class tree_set;
 
+template<class Map>
+class versioned_map;
+
 template<class amap> amap map_union(amap, amap);
 template<class amap> amap map_intersect(amap, amap);
 template<class amap> amap map_difference(amap, amap);
@@ -29,7 +38,17 @@ amap map_union(amap, amap, const BinaryOp&);
 template<class amap, class BinaryOp>
 amap map_intersect(amap, amap, const BinaryOp& f);
 
-template <class K, class V, class AugmOp, class Compare = std::less<K> >
+template<class amap, class Add, class Remove, class Change>
+void map_diff(const amap&, const amap&, const Add&, const Remove&,
+	      const Change&);
+
+// Balance selects the balancing scheme: avl_tree (the default),
+// wb_tree for weight balanced trees, or treap_tree for treaps with
+// priorities hashed from keys (which requires std::hash<K>).  Policy
+// selects how nodes are stored (see node_policy.h).
+template <class K, class V, class AugmOp, class Compare = std::less<K>,
+          template<class> class Balance = avl_tree,
+          class Policy = default_node_policy>
 class augmented_map {
  public:
     typedef K                                     key_type;
@@ -40,26 +59,40 @@ class augmented_map {
     typedef maybe<entry_type>                     maybe_entry;
     typedef typename AugmOp::aug_t                aug_type;
     typedef std::pair<K, V>                       tuple;
-    typedef node<K, V, AugmOp, Compare>           node_type;
+    typedef node<K, V, AugmOp, Compare, Balance, Policy> node_type;
     typedef typename node_type::tree_type         tree_type;
-    typedef augmented_map<K, V, AugmOp, Compare>  map_type;
+    typedef augmented_map<K, V, AugmOp, Compare, Balance, Policy> map_type;
     typedef std::pair<map_type, map_type>         map_pair;
     typedef tree_operations<node_type>            tree_ops;
     typedef typename node_type::allocator         allocator;
     typedef typename tree_ops::split_info         split_info;
     typedef Compare                               compare_type;
+    typedef tree_cursor<node_type>                cursor;
+    typedef batch_op<K, V>                        batch_type;
+    typedef typename allocator::arena             arena;
 
     // empty constructor
-    augmented_map() : root(NULL) { allocator::init(); }
+    augmented_map() : root(NULL), alloc_arena(NULL) { allocator::init(); }
+
+    // An empty map whose nodes are allocated in arena a (see
+    // list_allocator).  Copies, and maps derived from it by range, split
+    // and the like, allocate there too; nodes copied on updates go in the
+    // arena of the node they copy.  Maps in different arenas should not
+    // be combined, as the result would refer to nodes in both.
+    explicit augmented_map(arena& a) : root(NULL), alloc_arena(&a) {
+      allocator::init(); }
 
-    // copy constructor, increment reference counce
-    augmented_map(const map_type& m) {root = m.root; increase(root);}
+    // copy constructor, increment reference counce (or copy the tree
+    // for nodes without reference counts, see node_policy.h)
+    augmented_map(const map_type& m) : alloc_arena(m.alloc_arena) {
+      root = tree_ops::t_share(m.root);}
 
     // move constructor, clear the source, leave reference count as is
-    augmented_map(map_type&& m) { root = m.root; m.root = NULL;}
+    augmented_map(map_type&& m) : alloc_arena(m.alloc_arena) {
+      root = m.root; m.root = NULL;}
 
     // singleton
-    augmented_map(const entry_type& e) { 
+    augmented_map(const entry_type& e) : alloc_arena(NULL) { 
         allocator::init();
         root = new node_type(e);
     }
@@ -67,7 +100,7 @@ class augmented_map {
     // construct from an array keeping one of the equal keys
     augmented_map(entry_type* s, entry_type* e, 
 		  bool is_sorted = false,
-		  bool sequential = false) : root(NULL) {
+		  bool sequential = false) : root(NULL), alloc_arena(NULL) {
       allocator::init();
       multi_insert(s, e, is_sorted, sequential);
     }
@@ -75,37 +108,100 @@ class augmented_map {
     // construct from an array with combining of equal keys
     template<class Combine>
     augmented_map(entry_type* s, entry_type* e, const Combine& f, 
-		  bool is_sorted = false, bool sequential = false) : root(NULL) {
+		  bool is_sorted = false, bool sequential = false)
+      : root(NULL), alloc_arena(NULL) {
       allocator::init();
       multi_insert(s, e, f, is_sorted, sequential);
     }
 
+    // construct from an array sorted by key with no equal keys, building
+    // the tree straight from the array, in arena a if given.  Unless
+    // trusted, the order is checked (in parallel) and the general
+    // construction used if it fails.
+    static map_type from_sorted_unique(entry_type* s, entry_type* e,
+				       bool trusted = false, arena* a = NULL) {
+      allocator::init();
+      return map_type(tree_ops::from_sorted_unique(s, e - s, trusted, a), a);
+    }
+
+    // as from_sorted_unique, placing the nodes in one slab in
+    // cache-oblivious order: about twice as slow to build, for faster
+    // searches in large maps that are read much more than updated
+    static map_type from_sorted_layout(entry_type* s, entry_type* e,
+				       bool trusted = false, arena* a = NULL) {
+      allocator::init();
+      return map_type(tree_ops::from_sorted_layout(s, e - s, trusted, a), a);
+    }
+
+    // the arena the map allocates in, NULL for the default pool
+    arena* get_arena() const { return alloc_arena; }
+
+    // moves the nodes of the map not shared with other maps into one
+    // new slab, in the same cache-oblivious order as from_sorted_layout,
+    // freeing their old places; see release_free_nodes
+    void compact() { root = tree_ops::t_layout(root); }
+
+    // Moves the entries of the subtrees at the given depth (the root is
+    // at depth 0) out to the file of s, in pages of at most page_entries
+    // entries (by default the leaf size, or 64 with leaf blocks off).
+    // Each page is kept as a leaf block whose entries are read back when
+    // first needed, and the nodes above the pages stay in memory, as do
+    // the sizes and augmented values of the pages.  So aug_val, and
+    // aug_left and the like bounded by keys in the levels above, read
+    // nothing back, and a find reads back one page.  Only this version
+    // of the map changes; other versions sharing the subtrees keep them
+    // in memory.  Needs paged storage (paged_map in page_store.h), and
+    // keys and values must be trivially copyable.
+    void evict(page_store& s, size_t depth, size_t page_entries = 0) {
+      static_assert(node_type::block_type::paged && node_type::has_count,
+		    "only maps with paged storage can be evicted");
+      static_assert(std::is_trivially_copyable<K>::value &&
+		    std::is_trivially_copyable<V>::value,
+		    "only maps of trivially copyable entries can be evicted");
+      if (page_entries == 0)
+	page_entries = tree_ops::leaf_size ? tree_ops::leaf_size : 64;
+      root = tree_ops::t_evict(root, depth, page_entries, s);}
+
     // clears contents, decrementing ref counts
     void clear() {
       if (allocator::initialized) decrease_recursive(root);
       root = NULL;
     }
 
+    // clears contents without freeing any nodes, for maps in an arena
+    // that is about to be destroyed as a whole.  The keys and values of
+    // nodes no other map refers to are still destroyed, and leaf blocks,
+    // which live outside the arena, released along with their pages in
+    // a page_store.
+    void abandon() {
+      if (allocator::initialized) abandon_recursive(root);
+      root = NULL;
+    }
+
     // destruct.   
     ~augmented_map() { clear(); }
 
-    // copy assignment, increase reference count
+    // copy assignment, increase reference count.  The map takes the
+    // arena of m along with its contents.
     map_type& operator = (const map_type& m) {
-      if (this != &m) { clear(); root = m.root; increase(root); }
+      if (this != &m) {
+	clear(); root = tree_ops::t_share(m.root); alloc_arena = m.alloc_arena; }
       return *this;
     }
 
     // move assignment, clear the source, leave reference count as is
     map_type& operator = (map_type&& m){
-      if (this != &m) { clear(); root = m.root; m.root = NULL;}
+      if (this != &m) {
+	clear(); root = m.root; m.root = NULL; alloc_arena = m.alloc_arena; }
       return *this; 
     }
 
     // some basic functions
-    size_t size() const { return get_node_count(root); }
-    void insert(const tuple& p) { root = tree_ops::t_insert(root, p); }
+    size_t size() const { return tree_ops::t_size(root); }
+    void insert(const tuple& p) {
+      root = tree_ops::t_insert(root, p, alloc_arena); }
     void remove(const key_type& k) { root = tree_ops::t_delete(root, k); }
-    bool empty() {return root == NULL;}
+    bool empty() const {return root == NULL;}
 
     // filters elements that satisfy the predicate when applied
     // to the key-value pair.   To keep old version asssign to another var.
@@ -115,36 +211,59 @@ class augmented_map {
     // insert multiple keys from an array
     void multi_insert(entry_type* s, entry_type* e, 
 		      bool is_sorted = false, bool sequential = false) {
-      root = tree_ops::multi_insert(root, s, e-s, is_sorted, sequential);}
+      root = tree_ops::multi_insert(root, s, e-s, is_sorted, sequential,
+				    alloc_arena);}
 
     // insert multiple keys from an array with an associative combiner
     template<class Combine>
     void multi_insert(entry_type* s, entry_type* e, const Combine& f, 
 		      bool is_sorted = false, bool sequential = false) {
-      root = tree_ops::multi_insert(root, s, e-s, f, is_sorted, sequential);}
+      root = tree_ops::multi_insert(root, s, e-s, f, is_sorted, sequential,
+				    alloc_arena);}
+
+    // remove multiple keys from an array
+    void multi_delete(key_type* s, key_type* e, 
+		      bool is_sorted = false, bool sequential = false) {
+      root = tree_ops::multi_delete(root, s, e-s, is_sorted, sequential);}
+
+    // update the values of keys already in the map from an array:
+    // duplicates in the array are combined with f, and the value of a
+    // key becomes f(value from the array, old value).  Keys not in the
+    // map are ignored.
+    template<class Combine>
+    void multi_update(entry_type* s, entry_type* e, const Combine& f, 
+		      bool is_sorted = false, bool sequential = false) {
+      root = tree_ops::multi_update(root, s, e-s, f, is_sorted, sequential);}
+
+    // apply a batch of inserts, upserts and removes from an array sorted
+    // by key in a single traversal.  Operations on the same key take
+    // effect in array order.
+    void apply_batch(batch_type* s, batch_type* e, bool sequential = false) {
+      root = tree_ops::apply_batch(root, s, e-s, sequential, alloc_arena);}
 
     // build a new tree with a reduction function for combining duplicates
     template<class Vin, class Reduce>
     void build_reduce(std::pair<K,Vin>* s, std::pair<K,Vin>* e,
 		      const Reduce& reduce, bool is_sorted = false) {
       clear();
-      root = tree_ops::build_reduce(s, e-s, reduce, is_sorted);}
+      root = tree_ops::build_reduce(s, e-s, reduce, is_sorted, alloc_arena);}
 
     // basic search routines
     maybe_value find(const key_type& key) const {
-      return node_to_val(tree_ops::t_find(root, key));}
+      const value_type* v = tree_ops::t_find(root, key);
+      return (v != NULL) ? maybe_value(*v) : maybe_value();}
     bool contains(const key_type& key) const {
       return (tree_ops::t_find(root, key) != NULL) ? true : false;}
     maybe_entry next(const key_type& key) const {
-      return node_to_entry(tree_ops::t_next(root, key));}
+      return tree_ops::t_next(root, key);}
     maybe_entry previous(const key_type& key) const {
-      return node_to_entry(tree_ops::t_previous(root, key));}
+      return tree_ops::t_previous(root, key);}
 
     // rank and select
-    size_t rank(const key_type& key) { return tree_ops::t_rank(root, key);}
+    size_t rank(const key_type& key) const { return tree_ops::t_rank(root, key);}
     entry_type select(const size_t rank) const {
-      const node_type* n = tree_ops::t_select(this->root, rank);
-      return (n == NULL) ? entry_type() : n->get_entry();
+      maybe_entry e = tree_ops::t_select(this->root, rank);
+      return e ? *e : entry_type();
     }
 
     // equality 
@@ -154,17 +273,17 @@ class augmented_map {
     bool operator != (const map_type& m) const { return !(*this == m); }
 
     // extract the augmented values
-    aug_type aug_val() {return root->aug_val;}
-    aug_type aug_left (const key_type& key) {
+    aug_type aug_val() const {return get_aug(root);}
+    aug_type aug_left (const key_type& key) const {
         return tree_ops::report_left(root, key);};
-    aug_type aug_right(const key_type& key) {
+    aug_type aug_right(const key_type& key) const {
         return tree_ops::report_right(root, key);};
-    aug_type aug_range(const key_type& key_left, const key_type& key_right) {
+    aug_type aug_range(const key_type& key_left, const key_type& key_right) const {
         return tree_ops::report_range(root, key_left, key_right);};
 
     template <class Func>
-    maybe_entry aug_select(Func f) {
-      return node_to_entry(tree_ops::aug_select(root, f));};
+    maybe_entry aug_select(Func f) const {
+      return tree_ops::aug_select(root, f);};
 
     // union, intersection and difference
     template<class amap> friend amap map_union(amap, amap);
@@ -174,32 +293,77 @@ class augmented_map {
     friend amap map_union(amap, amap, const BinaryOp&);
     template<class amap, class BinaryOp>
     friend amap map_intersect(amap, amap, const BinaryOp&);
+    template<class amap, class Add, class Remove, class Change>
+    friend void map_diff(const amap&, const amap&, const Add&,
+			 const Remove&, const Change&);
 
     map_type range(const key_type& low, const key_type& high) {
-      increase(this->root);
-      return tree_ops::t_range(root, low, high);
+      return map_type(tree_ops::t_range(tree_ops::t_share(root), low, high),
+		      alloc_arena);
+    }
+
+    // reduces map_fn(e) over the entries e with keys in [low, high] using
+    // the associative reduce_fn, returning identity if there are none.
+    // Walks the tree in place, so no nodes are copied as in range().
+    template<class Map, class Reduce, class T>
+    T map_reduce_range(const key_type& low, const key_type& high,
+                       const Map& map_fn, const Reduce& reduce_fn,
+                       const T& identity) const {
+      return tree_ops::t_map_reduce_range(root, low, high,
+                                          map_fn, reduce_fn, identity);
+    }
+
+    // as above with a value initialized identity
+    template<class Map, class Reduce>
+    typename std::result_of<Map(entry_type)>::type
+    map_reduce_range(const key_type& low, const key_type& high,
+                     const Map& map_fn, const Reduce& reduce_fn) const {
+      using T = typename std::result_of<Map(entry_type)>::type;
+      return map_reduce_range(low, high, map_fn, reduce_fn, T());
+    }
+
+    // applies f to each entry with key in [low, high] in parallel
+    template<class Func>
+    void foreach_range(const key_type& low, const key_type& high,
+                       const Func& f) const {
+      tree_ops::t_foreach_range(root, low, high, f);
     }
 
     map_pair split(const key_type& key) {
-      split_info split = tree_ops::t_split(this->root, key);
-      return std::make_pair(map_type(split.first), map_type(split.second));
+      split_info split = tree_ops::t_split(tree_ops::t_share(root), key);
+      return std::make_pair(map_type(split.first, alloc_arena),
+			    map_type(split.second, alloc_arena));
     }
 
+    // an in-order cursor, initially invalid until positioned with one of
+    // its seek methods.  The map must outlive the cursor and not change
+    // while it is used; iterate over a copy to get a stable snapshot.
+    cursor get_cursor() const { return cursor(root); }
+
     // extract entries from the map sequentially into an output iterator
     template<class OutIterator>
     void content(OutIterator out) const {
-      auto get = [] (node_type* t) { return t->get_entry(); };
+      auto get = [] (const entry_type& e) { return e; };
       tree_ops::t_collect_seq(root, out, get);}
 
     // extract entries from the map in parallel into an array
     entry_type* entries(entry_type* out) const {
-      auto get = [] (node_type* t) { return t->get_entry(); };
-      return tree_ops::t_collect(root, out, get);}
+      auto get = [] (const entry_type& e) { return e; };
+      tree_ops::t_collect_at(root, out, get);
+      return out;}
+
+    // writes the entries to the binary file path, replacing it
+    // atomically, and reads them back (see map_file.h for the format).
+    // Both return false on failure; load then leaves the map unchanged.
+    bool save(const std::string& path) const {
+      return map_file<map_type>::save(*this, path);}
+    bool load(const std::string& path) {
+      return map_file<map_type>::load(*this, path);}
 
     // extract keys from the map
     template<class OutIterator>
     void keys(OutIterator out) const {
-      auto get = [] (const node_type* t) -> key_type { return t->get_key();};
+      auto get = [] (const entry_type& e) -> key_type { return e.first;};
       tree_ops::t_collect_seq(root, out, get);}
 
     // initializing, reserving and finishing
@@ -207,7 +371,29 @@ class augmented_map {
     static void reserve(size_t n, bool randomize=false) {
       allocator::reserve(n, randomize);};
     static void finish() { allocator::finish(); }
+
+    // store subtrees of at most b entries built from here on as flat
+    // sorted leaf blocks, 0 (the default) to turn blocking off
+    static void set_leaf_size(size_t b) {
+      static_assert(node_type::has_count,
+		    "leaf blocks need nodes with order statistics");
+      tree_ops::leaf_size = b; }
+
+    // backing of node memory allocated from here on, e.g.
+    // pbbs::transparent_huge_pages to cut TLB misses on large maps
+    static void set_page_kind(pbbs::page_kind k) { allocator::set_page_kind(k); }
+
+    // NUMA placement of trees laid out by from_sorted_layout and compact:
+    // if set, the pages of the top levels, which every search visits, are
+    // interleaved over all nodes, and those of the subtrees below are
+    // local to the worker that builds them
+    static void set_interleave_top(bool b) { tree_ops::interleave_top = b; }
   
+    // returns to the system the memory of node slabs none of whose
+    // nodes are in use, giving the number of nodes released.  Must not
+    // run concurrently with other operations on maps of this type.
+    static size_t release_free_nodes() { return allocator::release_free(); }
+
     // some memory statistics
     static size_t num_allocated_nodes() {
         return allocator::num_allocated_blocks();}
@@ -220,8 +406,8 @@ class augmented_map {
     
     struct split_t {
       split_t(node_type* left, node_type* right,
-          key_type key, value_type val) 
-      : left(map_type(left)), right(map_type(right)),
+          key_type key, value_type val, arena* a) 
+      : left(map_type(left, a)), right(map_type(right, a)),
     key(key), val(val) {};
       map_type left;
       map_type right;
@@ -231,27 +417,21 @@ class augmented_map {
 
     split_t split_mid() {
       assert(root != NULL);
-      increase(root->lc);
-      increase(root->rc);
-      return split_t(root->lc, root->rc, root->get_key(), root->get_value());
+      if (root->is_block) root = root->expose();
+      return split_t(tree_ops::t_share(root->lc), tree_ops::t_share(root->rc),
+		     root->get_key(), root->get_value(), alloc_arena);
     }
 
     node_type* get_root() {return root;}
     friend class tree_set<K>;
+    template<class Map> friend class versioned_map;
 
  private:
 
-    augmented_map(node_type* r) : root(r) {};
-    
-    maybe_value node_to_val(node_type* a) const {
-      if (a != NULL) return maybe_value(a->get_value());
-      else return maybe_value();
-    }
- 
-   maybe_entry node_to_entry(node_type* a) const {
-      if (a != NULL) return maybe_entry(a->get_entry());
-      else return maybe_entry();
-    }
+    // the arena of a map made from a tree is that of its root
+    augmented_map(node_type* r)
+      : root(r), alloc_arena(r ? allocator::arena_of(r) : NULL) {};
+    augmented_map(node_type* r, arena* a) : root(r), alloc_arena(a) {};
 
     template<class OutIterator, class DataOut>
     void collect(const node_type*, OutIterator&, const DataOut&) const;
@@ -259,6 +439,7 @@ class augmented_map {
     node_type* move_root() {node_type* t = root; root = NULL; return t;};
 
     node_type* root;
+    arena* alloc_arena;  // where new nodes go, NULL for the default pool
 };
 
 template<class map>
@@ -273,16 +454,30 @@ map map_intersect(map m1, map m2) {
 
 template<class map, class BinaryOp>
 map map_union(map m1, map m2, const BinaryOp& op) {
-  return map(map::tree_ops::t_union(m1.move_root(), m2.move_root(), op));
+  typename map::arena* a = m1.alloc_arena;
+  return map(map::tree_ops::t_union(m1.move_root(), m2.move_root(), op), a);
 }
 
 template<class map, class BinaryOp>
 map map_intersect(map m1, map m2, const BinaryOp& op) {
-  return map(map::tree_ops::t_intersect(m1.move_root(), m2.move_root(), op));
+  typename map::arena* a = m1.alloc_arena;
+  return map(map::tree_ops::t_intersect(m1.move_root(), m2.move_root(), op), a);
 }
 
 template<class map>
 map map_difference(map m1, map m2) {
-  return map(map::tree_ops::t_difference(m1.move_root(), m2.move_root()));
+  typename map::arena* a = m1.alloc_arena;
+  return map(map::tree_ops::t_difference(m1.move_root(), m2.move_root()), a);
+}
+
+// Reports how m2 differs from m1: on_added(e) for each entry only in m2,
+// on_removed(e) for each entry only in m1, and on_changed(e1, e2) for
+// each key in both with different values (compared with ==).  Entries
+// are reported in key order.  Only descends where the two trees differ
+// by pointer, so comparing versions derived from each other is cheap.
+template<class map, class Add, class Remove, class Change>
+void map_diff(const map& m1, const map& m2, const Add& on_added,
+	      const Remove& on_removed, const Change& on_changed) {
+  map::tree_ops::t_diff(m1.root, m2.root, on_added, on_removed, on_changed);
 }
 
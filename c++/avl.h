@@ -4,6 +4,7 @@
 #include "common.h"
 #include <cstddef> 
 #include <utility>
+#include <functional>
 #include "abstract_node.h"
 
 template<class Node>
@@ -15,6 +16,12 @@ public:
     }
 
     static tree_size_t singleton_rank() { return 1; }
+
+    // balance is by rank, the height of the subtree
+    static constexpr bool uses_rank = true;
+
+    // recursively splitting a sorted array at the middle gives a valid tree
+    static constexpr bool mid_split_balanced = true;
     
     static Node* t_join(Node* t1, Node* t2, Node* k) {
         if (is_too_heavy(t1, t2)) {
@@ -89,3 +96,54 @@ public:
         return rebalance_left(ret);
     }
 };
+
+// Treap balance operations.  The priority of a node is a hash of its key,
+// so no rank is kept and the shape of a tree depends only on its set of
+// keys, not on the order of the operations that built it.  A leaf block
+// takes the priority of its first key, so with blocks the shape is only
+// canonical down to the blocks.
+template<class Node>
+class treap_tree {
+public:
+
+    static tree_size_t combine_ranks(tree_size_t l, tree_size_t r) {
+      return 0;
+    }
+
+    static tree_size_t singleton_rank() { return 0; }
+
+    static constexpr bool uses_rank = false;
+
+    // the shape is fixed by the priorities instead
+    static constexpr bool mid_split_balanced = false;
+
+    static Node* t_join(Node* t1, Node* t2, Node* k) {
+        if (t1 && is_above(t1, k) && (!t2 || is_above(t1, t2))) {
+            Node* ret = copy_if_needed(t1);
+            ret->rc = t_join(ret->rc, t2, k);
+            ret->update();
+            return ret;
+        } else if (t2 && is_above(t2, k)) {
+            Node* ret = copy_if_needed(t2);
+            ret->lc = t_join(t1, ret->lc, k);
+            ret->update();
+            return ret;
+        } else {
+            k->lc = t1, k->rc = t2;
+            k->update();
+            return k;
+        }
+    }
+
+    static unsigned int priority(const Node* t) {
+        size_t h = std::hash<typename Node::key_type>()(t->get_key());
+        return pbbs::hash((unsigned int) (h ^ (h >> 32)));
+    }
+
+    // whether t1 belongs above t2, ties broken by key
+    static inline bool is_above(const Node* t1, const Node* t2) {
+        unsigned int p1 = priority(t1), p2 = priority(t2);
+        return p1 > p2 || (p1 == p2 && 
+            typename Node::key_compare()(t1->get_key(), t2->get_key()));
+    }
+};
@@ -0,0 +1,112 @@
+// Combining front end for concurrent point updates
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "versioned_map.h"
+
+// Lets many threads insert and remove keys in a versioned_map at once.
+// Each update is appended to a shared buffer, and whichever waiting
+// thread gets the combiner lock takes the whole buffer, sorts it by key
+// and applies it as one parallel apply_batch, publishing a single new
+// version.  A call returns once its update is visible to new readers.
+//
+// All writes to the versioned_map must go through the same writer, since
+// the combiner lock is what keeps it to a single writer.
+//
+// If a log function is given, it is called with each combined buffer,
+// in submission order, before the buffer is applied (durable_map uses
+// it to write ahead).
+template<class Map>
+class batched_writer {
+ public:
+  using K = typename Map::key_type;
+  using E = typename Map::entry_type;
+  using batch_type = typename Map::batch_type;
+
+  using log_function = std::function<void(const std::vector<batch_type>&)>;
+
+  batched_writer(versioned_map<Map>& vm, log_function log = log_function())
+    : vm(vm), log(log), submitted(0), applied(0) {}
+
+  // adds the entry, replacing the value if the key is present
+  void insert(const E& e) {
+    submit(batch_type(batch_upsert, e.first, e.second)); }
+
+  // adds the entry only if the key is not present
+  void insert_if_absent(const E& e) {
+    submit(batch_type(batch_insert, e.first, e.second)); }
+
+  void remove(const K& k) { submit(batch_type(batch_remove, k)); }
+
+  // waits until all updates submitted so far are published
+  void flush() {
+    size_t ticket;
+    {
+      std::lock_guard<std::mutex> g(pending_lock);
+      ticket = submitted;
+    }
+    wait_for(ticket);
+  }
+
+  // runs f while no buffer is being combined, so that what was logged
+  // and what is published agree
+  template<class F>
+  void exclusive(const F& f) {
+    std::lock_guard<std::mutex> g(combiner);
+    f();
+  }
+
+ private:
+  void submit(const batch_type& op) {
+    size_t ticket;
+    {
+      std::lock_guard<std::mutex> g(pending_lock);
+      pending.push_back(op);
+      ticket = ++submitted;
+    }
+    wait_for(ticket);
+  }
+
+  // returns once update number ticket is published, combining if no
+  // other thread is
+  void wait_for(size_t ticket) {
+    while (applied.load() < ticket) {
+      if (combiner.try_lock()) {
+        if (applied.load() < ticket) combine();
+        combiner.unlock();
+      } else std::this_thread::yield();
+    }
+  }
+
+  void combine() {
+    std::vector<batch_type> ops;
+    size_t last;
+    {
+      std::lock_guard<std::mutex> g(pending_lock);
+      ops.swap(pending);
+      last = submitted;
+    }
+    if (log) log(ops);
+    // stable, so updates to the same key keep their submission order
+    typename Map::compare_type less;
+    std::stable_sort(ops.begin(), ops.end(),
+      [&] (const batch_type& a, const batch_type& b) {
+        return less(a.key, b.key);});
+    vm.update([&] (Map& m) {
+        m.apply_batch(ops.data(), ops.data() + ops.size());});
+    applied.store(last);
+  }
+
+  versioned_map<Map>& vm;
+  log_function log;
+  std::mutex pending_lock;  // protects pending and submitted
+  std::vector<batch_type> pending;
+  size_t submitted;
+  std::atomic<size_t> applied;
+  std::mutex combiner;
+};
@@ -10,6 +10,14 @@ struct get_left {
         { return a; }
 };
 
+// Whether op(v, v) == v for all v.  Union and intersection can then
+// return a subtree shared by both inputs as it is.
+template<class BinaryOp>
+struct is_idempotent : std::false_type {};
+
+template<class V>
+struct is_idempotent<get_left<V> > : std::true_type {};
+
 
 template <class T> 
 T* rebalance(T* current);
@@ -39,11 +47,7 @@ T* rotate_left(T* t) {
 
 template <class T> 
 T* double_rotate_right(T* t) {
-    if (t->lc->rc && t->lc->rc->ref_cnt > 1) {
-       T* tmp = t->lc->rc;
-       t->lc->rc = t->lc->rc->copy();
-       decrease_recursive(tmp);
-    }
+    if (t->lc->rc) t->lc->rc = copy_if_needed(t->lc->rc);
     
     t->lc = rotate_left(t->lc);
     return rotate_right(t);
@@ -52,11 +56,7 @@ T* double_rotate_right(T* t) {
 
 template <class T> 
 T* double_rotate_left(T* t) {
-    if (t->rc->lc && t->rc->lc->ref_cnt > 1) {
-       T* tmp = t->rc->lc;
-       t->rc->lc = t->rc->lc->copy();
-       decrease_recursive(tmp);
-    }
+    if (t->rc->lc) t->rc->lc = copy_if_needed(t->rc->lc);
         
     t->rc = rotate_right(t->rc);
     return rotate_left(t);
@@ -65,12 +65,13 @@ T* double_rotate_left(T* t) {
 template <class T> 
 size_t get_height(T* t) {
     if (!t) return 0;
-    return 1 + max(get_height(t->lc), get_height(t->rc));
+    if (t->is_block) return pbbs::log2_up(t->block_size() + 1);
+    return 1 + std::max(get_height(t->lc), get_height(t->rc));
 }
 
 template <class T> 
 bool check_balance(T* t) {
-    if(!t) return 1;
+    if(!t || t->is_block) return 1;
     bool ret = is_balanced(t);
     ret &= check_balance(t->rc);
     ret &= check_balance(t->lc);
@@ -80,8 +81,16 @@ bool check_balance(T* t) {
 template <class T> bool check_bst(T* t) {
     if (!t) return 1;
     bool ret = 1;
+    if (t->is_block) {
+      auto it = t->block_begin();
+      for (size_t i = 1; i < t->block_size(); i++) {
+        auto prev = it.key(); ++it;
+        ret &= prev <= it.key();
+      }
+      return ret;
+    }
     if (t->rc) ret &= t->key <= t->rc->key;
-    if (t->lc) ret &= t->key >= t->lc->key;
+    if (t->lc && !t->lc->is_block) ret &= t->key >= t->lc->key;
 
     ret &= check_bst(t->lc);
     ret &= check_bst(t->rc);
@@ -90,13 +99,23 @@ template <class T> bool check_bst(T* t) {
 
 template <class T> 
 inline size_t get_node_count(T* t) {
+    static_assert(T::has_count,
+		  "sizes need nodes with order statistics (see node_policy.h)");
     return !t ? 0 : t->node_cnt;
 }
 
+// the size of t for deciding what to do in parallel, which is only an
+// estimate for nodes without sizes
+template <class T> 
+inline size_t get_size_hint(T* t) {
+    return !t ? 0 : t->size_hint();
+}
+
+// drops a reference to t, freeing it if it was the last
 template <class T> 
 bool decrease(T* t) {
     if (t) { 
-      if (pbbs::fetch_and_add(&t->ref_cnt, -1) == 1) {
+      if (t->release()) {
             t->collect();
             return true;
         }
@@ -106,18 +125,21 @@ bool decrease(T* t) {
 
 template <class T> 
 inline void increase(T* t) {
-  if (t) pbbs::write_add(&t->ref_cnt, 1);
+  static_assert(T::has_refs,
+		"nodes without reference counts cannot be shared");
+  if (t) t->retain();
 }
 
 template <class T> 
 void decrease_recursive(T* t) {
     if (!t) return;
+    if (t->is_block) { decrease(t); return; }
 
     T* lsub = t->lc;
     T* rsub = t->rc;
 
     if (decrease(t)) {
-        size_t sz = get_node_count(lsub);
+        size_t sz = get_size_hint(lsub);
         if (sz >= node_limit) {
             cilk_spawn decrease_recursive(lsub);
             decrease_recursive(rsub);
@@ -129,17 +151,56 @@ void decrease_recursive(T* t) {
     }
 }
 
-// copy node if reference count is > 1
+// Drops a reference to t as decrease_recursive does, but for nodes no
+// longer referenced only destroys their entries and releases their leaf
+// blocks, leaving the memory of the nodes to be reclaimed with their
+// arena.  Entries that own memory elsewhere, such as maps nested as
+// values, are still released.
+template <class T>
+void abandon_recursive(T* t) {
+    if (!t) return;
+    if (!t->release()) return;
+    using K = typename T::key_type;
+    using V = typename T::value_type;
+    t->get_key().~K();
+    t->get_value().~V();
+    if (t->is_block) {
+        T::block_type::destroy(t->block, t->block_size());
+        return;
+    }
+    T* lsub = t->lc;
+    T* rsub = t->rc;
+    if (get_size_hint(lsub) >= node_limit) {
+        cilk_spawn abandon_recursive(lsub);
+        abandon_recursive(rsub);
+        cilk_sync;
+    } else {
+        abandon_recursive(lsub);
+        abandon_recursive(rsub);
+    }
+}
+
 template<class T>
-static T* copy_if_needed(T* t) {
-  T* res = t;
-  if (t->ref_cnt > 1) {
-    res = t->copy();
-    decrease_recursive(t);
-  }
+static T* copy_shared(T* t, std::true_type) {
+  T* res = t->copy();
+  decrease_recursive(t);
   return res;
 }
 
+// nodes without reference counts are never shared
+template<class T>
+static T* copy_shared(T* t, std::false_type) { return t; }
+
+// copy node if reference count is > 1, and expose leaf blocks so
+// the result always has regular node fields and children
+template<class T>
+static T* copy_if_needed(T* t) {
+  if (t->is_block) return t->expose();
+  if (t->is_shared())
+    return copy_shared(t, std::integral_constant<bool, T::has_refs>());
+  return t;
+}
+
 template<class T>
 static T* join_node(T* t1, T* t2, T* k) {
   k->lc = t1,
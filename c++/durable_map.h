@@ -0,0 +1,283 @@
+// Durable maps: a write-ahead log plus periodic checkpoints
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+#include "batched_writer.h"
+#include "map_file.h"
+#include "versioned_map.h"
+
+// A versioned_map whose updates survive the process.  Updates go through
+// a batched_writer, and each buffer it combines is appended to a log and
+// synced before it is applied, so one sync commits a whole group of
+// concurrent updates.  A call returns once its update is both durable and
+// visible.  Checkpoints save a snapshot with augmented_map::save and
+// start a new log.  Since snapshots share structure with the map, the
+// writer is held up only while the snapshot is taken and the log
+// switched, not while it is saved.
+//
+// The state at path is kept in three files: path.ckpt (the last
+// checkpoint), path.log (updates since) and, during a checkpoint,
+// path.log.old (updates before the checkpoint being written).  Replaying
+// an update that a checkpoint already holds does not change the result,
+// so after a crash at any point the state is the checkpoint followed by
+// both logs in order.  A group only partly written when the process died
+// is detected by its checksum and dropped.
+//
+// Keys and values must be trivially copyable.
+template<class Map>
+class durable_map {
+ public:
+  using K = typename Map::key_type;
+  using E = typename Map::entry_type;
+  using batch_type = typename Map::batch_type;
+
+  durable_map(size_t max_readers = 128)
+    : vm(max_readers), fd(-1), stopping(false),
+      writer(vm, [this] (const std::vector<batch_type>& ops) {
+	  append(ops);}) {}
+
+  ~durable_map() {
+    stop_checkpoints();
+    if (fd >= 0) close(fd);
+  }
+
+  // Recovers the map stored at path, or starts an empty one, and ends
+  // with a checkpoint so the log starts empty.  Returns false if the
+  // files cannot be read or written.
+  bool open(const std::string& p) {
+    static_assert(std::is_trivially_copyable<K>::value &&
+		  std::is_trivially_copyable<typename Map::value_type>::value,
+		  "only maps of trivially copyable entries can be durable");
+    path = p;
+    Map m;
+    struct stat st;
+    if (stat(checkpoint_path().c_str(), &st) == 0 &&
+	!m.load(checkpoint_path())) return false;
+    std::vector<batch_type> ops;
+    if (!read_log(old_log_path(), ops) || !read_log(log_path(), ops))
+      return false;
+    // stable, so updates to the same key keep their log order
+    typename Map::compare_type less;
+    std::stable_sort(ops.begin(), ops.end(),
+      [&] (const batch_type& a, const batch_type& b) {
+	return less(a.key, b.key);});
+    m.apply_batch(ops.data(), ops.data() + ops.size());
+    // the logs are only dropped once the recovered map is saved
+    if (!m.save(checkpoint_path())) return false;
+    sync_dir();
+    unlink(old_log_path().c_str());
+    vm.publish(std::move(m));
+    fd = new_log(log_path());
+    if (fd < 0) return false;
+    sync_dir();
+    return true;
+  }
+
+  // as for batched_writer, returning once the update is durable
+  void insert(const E& e) { writer.insert(e); }
+  void insert_if_absent(const E& e) { writer.insert_if_absent(e); }
+  void remove(const K& k) { writer.remove(k); }
+  void flush() { writer.flush(); }
+
+  // the current version, for readers
+  Map snapshot() { return vm.snapshot(); }
+  versioned_map<Map>& versions() { return vm; }
+
+  // Saves the current version as the checkpoint and drops the log
+  // before it.  Returns false, keeping the logs, if it cannot be saved.
+  // If an earlier checkpoint failed, path.log.old is still needed and
+  // the log is not rotated, so this round only drops path.log.old.
+  bool checkpoint() {
+    std::lock_guard<std::mutex> g(checkpoint_lock);
+    Map m;
+    bool ok = true;
+    writer.exclusive([&] () {
+	m = vm.snapshot();
+	if (access(old_log_path().c_str(), F_OK) == 0) return;
+	ok = (rename(log_path().c_str(), old_log_path().c_str()) == 0);
+	if (!ok) return;
+	close(fd);
+	fd = new_log(log_path());
+	if (fd < 0) {
+	  fprintf(stderr, "Cannot create log %s\n", log_path().c_str());
+	  exit(1);
+	}
+	sync_dir();});
+    ok = ok && m.save(checkpoint_path());
+    // the snapshot may hold the last references to nodes, which are
+    // freed where the combining thread cannot be allocating
+    writer.exclusive([&] () { m.clear(); });
+    if (!ok) return false;
+    sync_dir();
+    unlink(old_log_path().c_str());
+    return true;
+  }
+
+  // starts a thread taking a checkpoint every period
+  void start_checkpoints(std::chrono::milliseconds period) {
+    stop_checkpoints();
+    stopping = false;
+    checkpointer = std::thread([this, period] () {
+	std::unique_lock<std::mutex> l(stop_lock);
+	while (!stop_signal.wait_for(l, period, [this] {return stopping;})) {
+	  l.unlock();
+	  checkpoint();
+	  l.lock();
+	}});
+  }
+
+  void stop_checkpoints() {
+    {
+      std::lock_guard<std::mutex> g(stop_lock);
+      stopping = true;
+    }
+    stop_signal.notify_all();
+    if (checkpointer.joinable()) checkpointer.join();
+  }
+
+ private:
+  static constexpr uint32_t log_version = 1;
+
+  struct log_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t op_size;
+    uint32_t pad;
+  };
+
+  // each group of updates is preceded by its count and checksum
+  struct group_header {
+    uint64_t n;
+    uint64_t sum;
+  };
+
+  std::string checkpoint_path() const { return path + ".ckpt"; }
+  std::string log_path() const { return path + ".log"; }
+  std::string old_log_path() const { return path + ".log.old"; }
+
+  static log_header header() {
+    log_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "PAMLOG\n", sizeof(h.magic));
+    h.version = log_version;
+    h.byte_order = map_file_header::byte_order_mark;
+    h.key_size = sizeof(K);
+    h.value_size = sizeof(typename Map::value_type);
+    h.op_size = sizeof(batch_type);
+    return h;
+  }
+
+  // 64 bit FNV-1a
+  static uint64_t checksum(const char* p, size_t bytes) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < bytes; i++)
+      h = (h ^ (unsigned char) p[i]) * 1099511628211ULL;
+    return h;
+  }
+
+  // creates an empty log at p, returning its descriptor or -1
+  static int new_log(const std::string& p) {
+    int f = ::open(p.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (f < 0) return -1;
+    log_header h = header();
+    if (!pbbs::file_transfer(f, (char*) &h, sizeof(h), 0, true) ||
+	fsync(f) != 0) {
+      close(f);
+      return -1;
+    }
+    return f;
+  }
+
+  // Called by the writer with each combined buffer.  The group is
+  // durable once synced; an update that cannot be made durable must not
+  // be applied or acknowledged, so failing here ends the process.
+  void append(const std::vector<batch_type>& ops) {
+    if (ops.empty()) return;
+    const char* d = (const char*) ops.data();
+    size_t bytes = ops.size() * sizeof(batch_type);
+    group_header g;
+    g.n = ops.size();
+    g.sum = checksum(d, bytes);
+    std::vector<char> buf((const char*) &g, (const char*) (&g + 1));
+    buf.insert(buf.end(), d, d + bytes);
+    size_t done = 0;
+    while (done < buf.size()) {
+      ssize_t r = write(fd, buf.data() + done, buf.size() - done);
+      if (r <= 0) break;
+      done += r;
+    }
+    if (done < buf.size() || fdatasync(fd) != 0) {
+      fprintf(stderr, "Cannot write log %s\n", log_path().c_str());
+      exit(1);
+    }
+  }
+
+  // Appends the updates in the log at p, if there is one, to ops,
+  // stopping at a group cut short by a crash.  Returns false if the file
+  // exists but cannot be read or is not a log of this map type.
+  static bool read_log(const std::string& p, std::vector<batch_type>& ops) {
+    int f = ::open(p.c_str(), O_RDONLY);
+    if (f < 0) return errno == ENOENT;
+    struct stat st;
+    std::vector<char> buf;
+    bool ok = fstat(f, &st) == 0;
+    if (ok) {
+      buf.resize(st.st_size);
+      ok = pbbs::file_transfer_parallel(f, buf.data(), buf.size(), 0, false);
+    }
+    close(f);
+    log_header h = header();
+    if (!ok || buf.size() < sizeof(h) || memcmp(buf.data(), &h, sizeof(h)) != 0)
+      return false;
+    size_t pos = sizeof(h);
+    while (pos + sizeof(group_header) <= buf.size()) {
+      group_header g;
+      memcpy(&g, buf.data() + pos, sizeof(g));
+      size_t bytes = g.n * sizeof(batch_type);
+      const char* d = buf.data() + pos + sizeof(g);
+      if (bytes > buf.size() - pos - sizeof(g) || checksum(d, bytes) != g.sum)
+	break;
+      size_t k = ops.size();
+      ops.resize(k + g.n);
+      memcpy((void*) (ops.data() + k), d, bytes);
+      pos += sizeof(g) + bytes;
+    }
+    return true;
+  }
+
+  // makes the creation and renaming of the files at path durable
+  void sync_dir() {
+    size_t slash = path.rfind('/');
+    std::string dir = (slash == std::string::npos) ? "." :
+      (slash == 0 ? "/" : path.substr(0, slash));
+    int d = ::open(dir.c_str(), O_RDONLY);
+    if (d >= 0) { fsync(d); close(d); }
+  }
+
+  versioned_map<Map> vm;
+  std::string path;
+  int fd;  // the current log, written by the combining thread only
+  std::mutex checkpoint_lock;
+  std::thread checkpointer;
+  std::mutex stop_lock;
+  std::condition_variable stop_signal;
+  bool stopping;
+  batched_writer<Map> writer;
+};
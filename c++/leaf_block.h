@@ -0,0 +1,144 @@
+// Storage formats for the entries of leaf blocks
+#pragma once
+
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include "pbbs-include/utils.h"
+
+// Walks a sorted array of entries
+template<class K, class V>
+struct array_iter {
+  using E = std::pair<K,V>;
+  const E* p;
+
+  array_iter(const E* p) : p(p) {}
+  const K& key() const { return p->first; }
+  const V& value() const { return p->second; }
+  const E& operator * () const { return *p; }
+  void operator ++ () { ++p; }
+};
+
+// Walks a sorted array of keys as entries with default values
+template<class K, class V>
+struct key_iter {
+  using E = std::pair<K,V>;
+  const K* p;
+
+  key_iter(const K* p) : p(p) {}
+  const K& key() const { return *p; }
+  V value() const { return V(); }
+  E operator * () const { return E(*p, V()); }
+  void operator ++ () { ++p; }
+};
+
+// By default a block is just an array of entries.  first_key is only
+// needed by encoded formats and is ignored here.
+template<class K, class V, class Compare, class Enable = void>
+struct leaf_block {
+  using E = std::pair<K,V>;
+  using iterator = array_iter<K,V>;
+  static constexpr bool encoded = false;
+  // whether blocks can stand for entries in a page_store (paged_block)
+  static constexpr bool paged = false;
+
+  static void* create(const E* A, size_t n) {
+    E* d = pbbs::new_array_no_init<E>(n);
+    for (size_t i = 0; i < n; i++)
+      pbbs::assign_uninitialized(d[i], A[i]);
+    return d;
+  }
+
+  static void destroy(void* d, size_t n) {
+    pbbs::delete_array((E*) d, n);
+  }
+
+  static iterator begin(const void* d, size_t n, const K& first_key) {
+    return iterator((const E*) d);
+  }
+
+  // the entries as an array, or NULL if they must be decoded
+  static const E* array(const void* d) { return (const E*) d; }
+};
+
+// Integral keys in increasing order are difference encoded: the first
+// key is kept by the caller, and each following key is stored as its
+// gap to the previous one in a variable-length byte code (7 bits per
+// byte, high bit set on all but the last byte).  Values are kept in a
+// plain array ahead of the key bytes.
+template<class K, class V>
+struct leaf_block<K, V, std::less<K>,
+                  typename std::enable_if<std::is_integral<K>::value>::type> {
+  using E = std::pair<K,V>;
+  using UK = typename std::make_unsigned<K>::type;
+  static constexpr bool encoded = true;
+  static constexpr bool paged = false;
+
+  struct iterator {
+    K k;
+    const V* v;
+    const unsigned char* p;
+    size_t left; // entries remaining, including the current one
+
+    iterator(K k, const V* v, const unsigned char* p, size_t n)
+      : k(k), v(v), p(p), left(n) {}
+    const K& key() const { return k; }
+    const V& value() const { return *v; }
+    E operator * () const { return E(k, *v); }
+    void operator ++ () {
+      ++v;
+      if (--left == 0) return;
+      UK gap = 0;
+      int shift = 0;
+      while (*p & 128) {
+        gap |= ((UK) (*p++ & 127)) << shift;
+        shift += 7;
+      }
+      gap |= ((UK) *p++) << shift;
+      k = (K) ((UK) k + gap);
+    }
+  };
+
+  static size_t code_size(UK gap) {
+    size_t r = 1;
+    while (gap >= 128) { gap >>= 7; r++; }
+    return r;
+  }
+
+  static size_t value_bytes(size_t n) {
+    return n * sizeof(V);
+  }
+
+  static void* create(const E* A, size_t n) {
+    size_t bytes = 0;
+    for (size_t i = 1; i < n; i++)
+      bytes += code_size((UK) A[i].first - (UK) A[i-1].first);
+    char* d = pbbs::new_array_no_init<char>(value_bytes(n) + bytes);
+    V* vals = (V*) d;
+    for (size_t i = 0; i < n; i++)
+      pbbs::assign_uninitialized(vals[i], A[i].second);
+    unsigned char* p = (unsigned char*) d + value_bytes(n);
+    for (size_t i = 1; i < n; i++) {
+      UK gap = (UK) A[i].first - (UK) A[i-1].first;
+      while (gap >= 128) {
+        *p++ = (unsigned char) (gap & 127) | 128;
+        gap >>= 7;
+      }
+      *p++ = (unsigned char) gap;
+    }
+    return d;
+  }
+
+  static void destroy(void* d, size_t n) {
+    if (!std::is_trivially_destructible<V>::value)
+      for (size_t i = 0; i < n; i++) ((V*) d)[i].~V();
+    free(d);
+  }
+
+  static iterator begin(const void* d, size_t n, const K& first_key) {
+    return iterator(first_key, (const V*) d,
+                    (const unsigned char*) d + value_bytes(n), n);
+  }
+
+  static const E* array(const void* d) { return NULL; }
+};
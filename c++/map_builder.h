@@ -0,0 +1,63 @@
+// Incremental construction of a map from a stream of chunks
+#pragma once
+
+#include <vector>
+#include <utility>
+#include "augmented_map.h"
+
+// Builds a map (any augmented_map type) from entries that arrive in
+// chunks, so the input never has to be in memory all at once.  Each
+// chunk is sorted and built into a tree in parallel, and the trees are
+// kept like the digits of a binary counter: level i holds at most one
+// tree built from about 2^i chunks, and a new tree is unioned into the
+// levels with carries.  Every entry therefore takes part in O(log c)
+// unions for c chunks, each run with the parallel t_union.
+//
+// For equal keys, entries from later chunks replace those from earlier
+// chunks; within a chunk one of them is kept, as with the array
+// constructor of augmented_map.
+template<class Map>
+class map_builder {
+ public:
+  using E = typename Map::entry_type;
+
+  map_builder() {}
+
+  // adds the entries in [s, e), which are reordered in place; the
+  // caller can reuse the buffer once this returns
+  void add_chunk(E* s, E* e, bool is_sorted = false) {
+    if (s == e) return;
+    add(Map(s, e, is_sorted));
+  }
+
+  // adds all entries of m, which take precedence over earlier ones
+  void add(Map m) {
+    for (size_t i = 0; ; i++) {
+      if (i == levels.size()) levels.push_back(Map());
+      if (levels[i].size() == 0) {
+	levels[i] = std::move(m);
+	return;
+      }
+      m = map_union(std::move(m), std::move(levels[i]));
+    }
+  }
+
+  // an upper bound on the number of distinct keys added so far
+  size_t size() const {
+    size_t n = 0;
+    for (auto& l : levels) n += l.size();
+    return n;
+  }
+
+  // the map of all entries added, leaving the builder empty
+  Map finish() {
+    Map r;
+    for (size_t i = 0; i < levels.size(); i++)
+      r = map_union(std::move(r), std::move(levels[i]));
+    levels.clear();
+    return r;
+  }
+
+ private:
+  std::vector<Map> levels;
+};
@@ -0,0 +1,125 @@
+// Binary files holding the entries of a map
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <type_traits>
+#include "common.h"
+#include "pbbs-include/file_io.h"
+
+// The file format written by augmented_map::save.  A header, then the
+// augmented value of the whole map (if aug_size is not 0), then the n
+// entries in key order, each as the bytes of an entry_type.  Only maps
+// whose keys and values are trivially copyable can be saved, and a file
+// can only be loaded into a map whose sizes and byte order match the
+// header.  The augmented value is only recorded when its type is
+// trivially copyable, so tools can read the total without loading.
+struct map_file_header {
+  static constexpr uint32_t current_version = 1;
+  static constexpr uint32_t byte_order_mark = 0x01020304;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t entry_size;
+  uint32_t aug_size;
+  uint64_t n;
+
+  static const char* magic_string() { return "PAMMAP\n"; }
+
+  bool matches(size_t k, size_t v, size_t e, size_t a) const {
+    return (memcmp(magic, magic_string(), sizeof(magic)) == 0 &&
+	    version == current_version && byte_order == byte_order_mark &&
+	    key_size == k && value_size == v && entry_size == e &&
+	    aug_size == a);
+  }
+};
+
+template<class Map>
+struct map_file {
+  using K = typename Map::key_type;
+  using V = typename Map::value_type;
+  using E = typename Map::entry_type;
+  using A = typename Map::aug_type;
+
+  static constexpr size_t aug_size =
+    std::is_trivially_copyable<A>::value ? sizeof(A) : 0;
+
+  static map_file_header header(size_t n) {
+    map_file_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, map_file_header::magic_string(), sizeof(h.magic));
+    h.version = map_file_header::current_version;
+    h.byte_order = map_file_header::byte_order_mark;
+    h.key_size = sizeof(K);
+    h.value_size = sizeof(V);
+    h.entry_size = sizeof(E);
+    h.aug_size = aug_size;
+    h.n = n;
+    return h;
+  }
+
+  // Writes the entries of m to path.  The file is written beside path
+  // and renamed over it once synced, so path always holds either the old
+  // or the new contents.  Returns false if any write fails.
+  static bool save(const Map& m, const std::string& path) {
+    static_assert(std::is_trivially_copyable<K>::value &&
+		  std::is_trivially_copyable<V>::value,
+		  "only maps of trivially copyable entries can be saved");
+    size_t n = m.size();
+    map_file_header h = header(n);
+    A a = m.aug_val();
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    E* out = pbbs::new_array_no_init<E>(n, true);
+    m.entries(out);
+    off_t start = sizeof(h) + aug_size;
+    bool ok = (pbbs::file_transfer(fd, (char*) &h, sizeof(h), 0, true) &&
+	       pbbs::file_transfer(fd, (char*) &a, aug_size, sizeof(h), true) &&
+	       pbbs::file_transfer_parallel(fd, (char*) out, n * sizeof(E),
+					    start, true));
+    free(out);
+    ok = (fsync(fd) == 0) && ok;
+    ok = (close(fd) == 0) && ok;
+    if (ok) ok = (rename(tmp.c_str(), path.c_str()) == 0);
+    if (!ok) unlink(tmp.c_str());
+    return ok;
+  }
+
+  // Reads a file written by save into m, replacing its contents.  The
+  // entries are already in key order, so the tree is built straight from
+  // them with from_sorted_unique.  Returns false, leaving m unchanged, if
+  // the file cannot be read or was written for a different map type.
+  static bool load(Map& m, const std::string& path) {
+    static_assert(std::is_trivially_copyable<K>::value &&
+		  std::is_trivially_copyable<V>::value,
+		  "only maps of trivially copyable entries can be loaded");
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    map_file_header h;
+    if (!pbbs::file_transfer(fd, (char*) &h, sizeof(h), 0, false) ||
+	!h.matches(sizeof(K), sizeof(V), sizeof(E), aug_size)) {
+      close(fd);
+      return false;
+    }
+    size_t n = h.n;
+    E* in = pbbs::new_array_no_init<E>(n, true);
+    off_t start = sizeof(h) + aug_size;
+    bool ok = pbbs::file_transfer_parallel(fd, (char*) in, n * sizeof(E),
+					   start, false);
+    close(fd);
+    // the order is still checked, so a damaged file cannot give an
+    // unordered tree
+    if (ok) m = Map::from_sorted_unique(in, in + n);
+    free(in);
+    return ok;
+  }
+};
@@ -0,0 +1,356 @@
+// Read-only memory-mapped images of a map
+#pragma once
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "map_file.h"
+
+// An image of a map is a file holding its tree with no pointers in it,
+// so it can be mapped into memory and searched in place by any number of
+// processes, which then share one copy in the page cache.  Each node
+// holds an entry, the augmented value and size of its subtree, and the
+// positions of its children in the node array (all ones for none).  The
+// root is at position 0 and nodes are in preorder, so a node and its
+// left child are adjacent, and the tree is the balanced one obtained by
+// splitting the entries at the middle.
+//
+// Keys, values and augmented values must be trivially copyable, and an
+// image can only be opened by a map_image of the same map type on a
+// machine of the same byte order.
+struct map_image_header {
+  static constexpr uint32_t current_version = 1;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t aug_size;
+  uint32_t node_size;
+  uint64_t n;
+  char pad[24];  // the nodes start on a cache line
+
+  static const char* magic_string() { return "PAMIMG\n"; }
+};
+
+template<class Map>
+class map_image {
+ public:
+  using K = typename Map::key_type;
+  using V = typename Map::value_type;
+  using E = typename Map::entry_type;
+  using A = typename Map::aug_type;
+  using aug_class = typename Map::tree_ops::aug_class;
+  using key_compare = typename Map::compare_type;
+
+  struct image_node {
+    E entry;
+    A aug;
+    uint64_t size;
+    uint64_t lc, rc;
+  };
+
+  map_image() : base(NULL), length(0), nodes(NULL), n(0) {}
+  ~map_image() { close(); }
+  map_image(const map_image&) = delete;
+  map_image& operator=(const map_image&) = delete;
+
+  // Writes the image of m to path, replacing it atomically as
+  // map_file::save does.  Returns false if any write fails.
+  static bool write(const Map& m, const std::string& path) {
+    static_assert(std::is_trivially_copyable<K>::value &&
+		  std::is_trivially_copyable<V>::value &&
+		  std::is_trivially_copyable<A>::value,
+		  "images need trivially copyable entries and aug values");
+    size_t n = m.size();
+    map_image_header h = header(n);
+    E* in = pbbs::new_array_no_init<E>(n);
+    m.entries(in);
+    image_node* T = pbbs::new_array_no_init<image_node>(n, true);
+    if (n > 0) build(T, in, 0, n, 0);
+    free(in);
+
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { free(T); return false; }
+    bool ok = (pbbs::file_transfer(fd, (char*) &h, sizeof(h), 0, true) &&
+	       pbbs::file_transfer_parallel(fd, (char*) T,
+					    n * sizeof(image_node),
+					    sizeof(h), true));
+    free(T);
+    ok = (fsync(fd) == 0) && ok;
+    ok = (::close(fd) == 0) && ok;
+    if (ok) ok = (rename(tmp.c_str(), path.c_str()) == 0);
+    if (!ok) unlink(tmp.c_str());
+    return ok;
+  }
+
+  // Maps the image at path read-only, replacing any image open before.
+  // Returns false if it cannot be mapped or is not an image of this
+  // map type.
+  bool open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(map_image_header)) {
+      ::close(fd);
+      return false;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+    const map_image_header* h = (const map_image_header*) p;
+    map_image_header e = header(h->n);
+    if (memcmp(h, &e, offsetof(map_image_header, pad)) != 0 ||
+	(size_t) st.st_size < sizeof(e) + h->n * sizeof(image_node)) {
+      munmap(p, st.st_size);
+      return false;
+    }
+    base = p;
+    length = st.st_size;
+    n = h->n;
+    nodes = (const image_node*) ((const char*) p + sizeof(e));
+    return true;
+  }
+
+  void close() {
+    if (base) munmap(base, length);
+    base = NULL; length = 0; nodes = NULL; n = 0;
+  }
+
+  size_t size() const { return n; }
+
+  // The same queries as on augmented_map, answered on the mapped nodes.
+
+  maybe<V> find(const K& k) const {
+    uint64_t t = root();
+    while (t != none) {
+      const image_node& x = nodes[t];
+      if (comp(k, x.entry.first)) t = x.lc;
+      else if (comp(x.entry.first, k)) t = x.rc;
+      else return maybe<V>(x.entry.second);
+    }
+    return maybe<V>();
+  }
+
+  bool contains(const K& k) const { return find(k).valid; }
+
+  // the number of keys less than k
+  size_t rank(const K& k) const {
+    size_t r = 0;
+    uint64_t t = root();
+    while (t != none) {
+      const image_node& x = nodes[t];
+      if (comp(x.entry.first, k)) {
+	r += 1 + size_of(x.lc);
+	t = x.rc;
+      } else t = x.lc;
+    }
+    return r;
+  }
+
+  // the entry with rank r (0 based), a default entry if r >= size
+  E select(size_t r) const {
+    uint64_t t = root();
+    while (t != none) {
+      const image_node& x = nodes[t];
+      size_t left_size = size_of(x.lc);
+      if (r < left_size) t = x.lc;
+      else if (r == left_size) return x.entry;
+      else { r -= left_size + 1; t = x.rc; }
+    }
+    return E();
+  }
+
+  A aug_val() const { return aug_of(root()); }
+
+  // the augmented value of the entries with keys at most k
+  A aug_left(const K& k) const { return aug_left_from(root(), k); }
+
+  // the augmented value of the entries with keys at least k
+  A aug_right(const K& k) const { return aug_right_from(root(), k); }
+
+  // the augmented value of the entries with keys in [kl, kr]
+  A aug_range(const K& kl, const K& kr) const {
+    uint64_t t = root();
+    while (t != none) {
+      const image_node& x = nodes[t];
+      if (comp(kr, x.entry.first)) t = x.lc;
+      else if (comp(x.entry.first, kl)) t = x.rc;
+      else {
+	A r = aug_class::combine(aug_right_from(x.lc, kl), entry_aug(x));
+	return aug_class::combine(r, aug_left_from(x.rc, kr));
+      }
+    }
+    return aug_class::get_empty();
+  }
+
+  // An in-order cursor with the interface of tree_cursor.  The image
+  // must stay open while it is used.
+  class cursor {
+   public:
+    cursor(const map_image& img) : img(img) {}
+
+    bool valid() const { return !path.empty(); }
+    K get_key() const { return cur().entry.first; }
+    V get_value() const { return cur().entry.second; }
+    E get_entry() const { return cur().entry; }
+
+    void seek_first() {
+      path.clear();
+      if (img.n) push_leftmost(img.root());
+    }
+
+    void seek_last() {
+      path.clear();
+      if (img.n) push_rightmost(img.root());
+    }
+
+    // position at the first entry with key not less than k
+    void seek(const K& k) {
+      path.clear();
+      size_t found = 0;
+      uint64_t t = img.root();
+      while (t != none) {
+	path.push_back(t);
+	if (comp(img.nodes[t].entry.first, k)) t = img.nodes[t].rc;
+	else { found = path.size(); t = img.nodes[t].lc; }
+      }
+      path.resize(found);
+    }
+
+    // position at the entry with rank r, invalid if r >= size
+    void seek_rank(size_t r) {
+      path.clear();
+      uint64_t t = img.root();
+      while (t != none) {
+	path.push_back(t);
+	size_t left_size = img.size_of(img.nodes[t].lc);
+	if (r < left_size) t = img.nodes[t].lc;
+	else if (r == left_size) return;
+	else { r -= left_size + 1; t = img.nodes[t].rc; }
+      }
+      path.clear();
+    }
+
+    void next() {
+      uint64_t t = path.back();
+      if (img.nodes[t].rc != none) { push_leftmost(img.nodes[t].rc); return; }
+      path.pop_back();
+      while (!path.empty() && cur().rc == t) {
+	t = path.back();
+	path.pop_back();
+      }
+    }
+
+    void prev() {
+      uint64_t t = path.back();
+      if (img.nodes[t].lc != none) { push_rightmost(img.nodes[t].lc); return; }
+      path.pop_back();
+      while (!path.empty() && cur().lc == t) {
+	t = path.back();
+	path.pop_back();
+      }
+    }
+
+   private:
+    const image_node& cur() const { return img.nodes[path.back()]; }
+
+    void push_leftmost(uint64_t t) {
+      for (; t != none; t = img.nodes[t].lc) path.push_back(t);
+    }
+
+    void push_rightmost(uint64_t t) {
+      for (; t != none; t = img.nodes[t].rc) path.push_back(t);
+    }
+
+    const map_image& img;
+    std::vector<uint64_t> path;
+  };
+
+  cursor get_cursor() const { return cursor(*this); }
+
+ private:
+  static constexpr uint64_t none = ~((uint64_t) 0);
+
+  static map_image_header header(size_t n) {
+    map_image_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, map_image_header::magic_string(), sizeof(h.magic));
+    h.version = map_image_header::current_version;
+    h.byte_order = map_file_header::byte_order_mark;
+    h.key_size = sizeof(K);
+    h.value_size = sizeof(V);
+    h.aug_size = sizeof(A);
+    h.node_size = sizeof(image_node);
+    h.n = n;
+    return h;
+  }
+
+  // fills T[pos..] with the preorder nodes of the tree of A[l, r)
+  static void build(image_node* T, const E* in, size_t l, size_t r,
+		    uint64_t pos) {
+    size_t m = l + (r - l) / 2;
+    image_node& x = T[pos];
+    memset((void*) &x, 0, sizeof(x));  // no stray bytes in the file
+    x.entry = in[m];
+    x.size = r - l;
+    x.lc = (m > l) ? pos + 1 : none;
+    x.rc = (r > m + 1) ? pos + 1 + (m - l) : none;
+    auto left = [&] () { if (x.lc != none) build(T, in, l, m, x.lc); };
+    auto right = [&] () { if (x.rc != none) build(T, in, m + 1, r, x.rc); };
+    par_do(r - l >= node_limit, left, right);
+    A a = aug_class::from_entry(x.entry.first, x.entry.second);
+    if (x.lc != none) a = aug_class::combine(T[x.lc].aug, a);
+    if (x.rc != none) a = aug_class::combine(a, T[x.rc].aug);
+    x.aug = a;
+  }
+
+  uint64_t root() const { return n ? 0 : none; }
+
+  size_t size_of(uint64_t t) const { return t == none ? 0 : nodes[t].size; }
+  A aug_of(uint64_t t) const {
+    return t == none ? aug_class::get_empty() : nodes[t].aug; }
+  static A entry_aug(const image_node& x) {
+    return aug_class::from_entry(x.entry.first, x.entry.second); }
+
+  A aug_left_from(uint64_t t, const K& k) const {
+    A r = aug_class::get_empty();
+    while (t != none) {
+      const image_node& x = nodes[t];
+      if (!comp(k, x.entry.first)) {
+	r = aug_class::combine(r, aug_class::combine(aug_of(x.lc), entry_aug(x)));
+	t = x.rc;
+      } else t = x.lc;
+    }
+    return r;
+  }
+
+  A aug_right_from(uint64_t t, const K& k) const {
+    A r = aug_class::get_empty();
+    while (t != none) {
+      const image_node& x = nodes[t];
+      if (!comp(x.entry.first, k)) {
+	r = aug_class::combine(aug_class::combine(entry_aug(x), aug_of(x.rc)), r);
+	t = x.lc;
+      } else t = x.rc;
+    }
+    return r;
+  }
+
+  static bool comp(const K& a, const K& b) { return key_compare()(a, b); }
+
+  void* base;
+  size_t length;
+  const image_node* nodes;
+  size_t n;
+};
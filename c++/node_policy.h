@@ -0,0 +1,34 @@
+// Choices in how nodes are stored
+#pragma once
+
+#include "leaf_block.h"
+
+// The Policy parameter of augmented_map.  block is the storage of the
+// entries of leaf blocks: leaf_block by default, or paged_block for maps
+// that can be evicted to a file (paged_map in page_store.h).  Custom
+// policies derive from this one and override what they change.
+//
+// The flags say which features nodes carry fields for, and turning one
+// off drops its field from every node:
+//
+//  order_statistics: the subtree size (node_cnt), needed by rank,
+//    select, leaf blocks, eviction and wb_tree.  Without it size() walks
+//    the whole tree, entries() collects sequentially, and the sizes that
+//    decide what runs in parallel are estimated from ranks, so the
+//    balance scheme must use them (avl_tree).
+//  augmentation: the augmented value, so AugmOp is ignored and no aug
+//    queries are allowed.  Maps with noop augmentation never keep it.
+//  persistence: the reference count.  No two maps then share a node, so
+//    copies of a map, and range and split, copy the whole tree, and
+//    versioned_map is not available.
+//
+// E.g. with all three off a tree_map<int,int> node takes 32 bytes rather
+// than 40, and the node of a set of ints 24 rather than 32.
+struct default_node_policy {
+  template<class K, class V, class Compare>
+  using block = leaf_block<K, V, Compare>;
+
+  static constexpr bool order_statistics = true;
+  static constexpr bool augmentation = true;
+  static constexpr bool persistence = true;
+};
@@ -0,0 +1,198 @@
+// Subtrees kept in a file and read back on demand
+#pragma once
+
+#include <atomic>
+#include <fcntl.h>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <unistd.h>
+#include "augmented_map.h"
+#include "pbbs-include/file_io.h"
+
+// A scratch file that evicted subtrees of maps are appended to (see
+// augmented_map::evict and paged_map below).  Each page is written once
+// as the array of its entries and never changed, so the leaf blocks
+// standing for them can be shared between versions like any other node.
+// The file is removed when the store is closed, and the store must
+// outlive every map with subtrees in it.
+class page_store {
+ public:
+  // the entries of one evicted page, and the leaf block holding them
+  // in memory once read back
+  struct page {
+    page_store* store;
+    size_t offset, n;
+    std::atomic<void*> resident;
+    void (*drop)(void*, size_t);  // destroys the resident block
+    page* prev;
+    page* next;
+  };
+
+  page_store() : fd(-1), end(0), faults(0), bytes_read(0), head(NULL) {}
+  ~page_store() { close(); }
+  page_store(const page_store&) = delete;
+  page_store& operator=(const page_store&) = delete;
+
+  // creates the file at path, returning false if it cannot
+  bool open(const std::string& path) {
+    close();
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return false;
+    unlink(path.c_str());
+    end = 0;
+    return true;
+  }
+
+  void close() {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+  }
+
+  // appends the bytes of [p, p + bytes), setting offset to where they
+  // went, or returns false
+  bool append(const char* p, size_t bytes, size_t& offset) {
+    offset = end.fetch_add(bytes);
+    return pbbs::file_transfer_parallel(fd, (char*) p, bytes, offset, true);
+  }
+
+  // reads back bytes appended at offset; a failure here cannot be
+  // recovered from, since the entries exist nowhere else
+  void read(char* p, size_t bytes, size_t offset) {
+    faults++;
+    bytes_read += bytes;
+    if (!pbbs::file_transfer_parallel(fd, p, bytes, offset, false)) {
+      fprintf(stderr, "Cannot read evicted entries\n");
+      exit(1);
+    }
+  }
+
+  page* add_page(size_t offset, size_t n, void (*drop)(void*, size_t)) {
+    page* pg = new page;
+    pg->store = this;
+    pg->offset = offset;
+    pg->n = n;
+    pg->resident.store(NULL);
+    pg->drop = drop;
+    std::lock_guard<std::mutex> g(lock);
+    pg->prev = NULL;
+    pg->next = head;
+    if (head) head->prev = pg;
+    head = pg;
+    return pg;
+  }
+
+  // called when the last node referring to pg is freed.  The space in
+  // the file is not reused.
+  void remove_page(page* pg) {
+    {
+      std::lock_guard<std::mutex> g(lock);
+      if (pg->prev) pg->prev->next = pg->next;
+      else head = pg->next;
+      if (pg->next) pg->next->prev = pg->prev;
+    }
+    void* r = pg->resident.load();
+    if (r) pg->drop(r, pg->n);
+    delete pg;
+  }
+
+  // Drops the entries read back into memory, giving the number of
+  // pages dropped.  They are read again when next needed.  Must not run
+  // concurrently with other operations on maps with pages in the store.
+  size_t release_resident() {
+    std::lock_guard<std::mutex> g(lock);
+    size_t k = 0;
+    for (page* pg = head; pg; pg = pg->next) {
+      void* r = pg->resident.exchange(NULL);
+      if (r) { pg->drop(r, pg->n); k++; }
+    }
+    return k;
+  }
+
+  // the number of pages read back so far
+  size_t num_faults() const { return faults.load(); }
+
+  // the bytes written to the file so far
+  size_t num_bytes() const { return end.load(); }
+
+  // the bytes read back so far
+  size_t num_bytes_read() const { return bytes_read.load(); }
+
+ private:
+  int fd;
+  std::atomic<size_t> end;
+  std::atomic<size_t> faults;
+  std::atomic<size_t> bytes_read;
+  std::mutex lock;  // protects the list of pages
+  page* head;
+};
+
+// Leaf block storage that can also refer to entries in a page_store.
+// Blocks in memory are in the format of leaf_block.  Those in a store
+// are page pointers tagged in the low bit, and their entries are read
+// back and converted to that format the first time they are needed, so
+// all code using leaf blocks works on evicted subtrees unchanged.
+template<class K, class V, class Compare>
+struct paged_block {
+  using base = leaf_block<K, V, Compare>;
+  using E = std::pair<K,V>;
+  using iterator = typename base::iterator;
+  using page = page_store::page;
+  static constexpr bool encoded = base::encoded;
+  static constexpr bool paged = true;
+
+  static bool is_paged(const void* d) { return ((uintptr_t) d) & 1; }
+  static page* get_page(const void* d) { return (page*) ((uintptr_t) d - 1); }
+
+  static void* create(const E* A, size_t n) { return base::create(A, n); }
+
+  // writes the n entries of A to s, returning the block or NULL if
+  // they cannot be written.  The entries must be trivially copyable.
+  static void* create_paged(page_store& s, const E* A, size_t n) {
+    size_t offset;
+    if (!s.append((const char*) A, n * sizeof(E), offset)) return NULL;
+    page* pg = s.add_page(offset, n, &base::destroy);
+    return (void*) ((uintptr_t) pg + 1);
+  }
+
+  static void destroy(void* d, size_t n) {
+    if (!is_paged(d)) base::destroy(d, n);
+    else get_page(d)->store->remove_page(get_page(d));
+  }
+
+  // the block in memory, reading it back if needed
+  static const void* resident(const void* d) {
+    if (!is_paged(d)) return d;
+    page* pg = get_page(d);
+    void* r = pg->resident.load(std::memory_order_acquire);
+    if (r != NULL) return r;
+    E* A = pbbs::new_array_no_init<E>(pg->n);
+    pg->store->read((char*) A, pg->n * sizeof(E), pg->offset);
+    void* mine = base::create(A, pg->n);
+    free(A);
+    // another thread may have read it meanwhile
+    if (pg->resident.compare_exchange_strong(r, mine)) return mine;
+    base::destroy(mine, pg->n);
+    return r;
+  }
+
+  static iterator begin(const void* d, size_t n, const K& first_key) {
+    return base::begin(resident(d), n, first_key);
+  }
+
+  static const E* array(const void* d) { return base::array(resident(d)); }
+};
+
+struct paged_node_policy : default_node_policy {
+  template<class K, class V, class Compare>
+  using block = paged_block<K, V, Compare>;
+};
+
+// A map whose subtrees can be evicted to a page_store (see
+// augmented_map::evict).  Maps using the default leaf_block storage
+// cannot, and save the check for evicted blocks on each access.
+template<class K, class V, class AugmOp, class Compare = std::less<K>,
+         template<class> class Balance = avl_tree>
+using paged_map = augmented_map<K, V, AugmOp, Compare, Balance,
+                                paged_node_policy>;
@@ -0,0 +1,39 @@
+// Positioned reads and writes of file ranges
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <unistd.h>
+#include "utils.h"
+
+namespace pbbs {
+
+  // pwrite (if out) or pread of all of [p, p + bytes) at offset,
+  // retrying short transfers.  Returns false on an error or end of file.
+  inline bool file_transfer(int fd, char* p, size_t bytes, off_t offset,
+			    bool out) {
+    while (bytes > 0) {
+      ssize_t r = out ? pwrite(fd, p, bytes, offset)
+	              : pread(fd, p, bytes, offset);
+      if (r <= 0) return false;
+      p += r; bytes -= r; offset += r;
+    }
+    return true;
+  }
+
+  // As above, in pieces of 4MB transferred in parallel.
+  inline bool file_transfer_parallel(int fd, char* p, size_t bytes,
+				     off_t offset, bool out) {
+    const size_t chunk = 1 << 22;
+    size_t chunks = (bytes + chunk - 1) / chunk;
+    std::atomic<bool> ok(true);
+    parallel_for (size_t i = 0; i < chunks; i++) {
+      size_t s = i * chunk;
+      size_t len = std::min(chunk, bytes - s);
+      if (!file_transfer(fd, p + s, len, offset + s, out))
+	ok.store(false, std::memory_order_relaxed);
+    }
+    return ok.load();
+  }
+
+}
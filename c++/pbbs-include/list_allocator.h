@@ -35,7 +35,10 @@
 #include <stdlib.h>
 #include <math.h>
 #include <atomic>
+#include <algorithm>
+#include <vector>
 #include "concurrent_stack.h"
+#include "memory_policy.h"
 #include "utils.h"
 #include "random_shuffle.h"
 
@@ -43,9 +46,15 @@ constexpr const size_t default_alloc_size = 1000000;
 constexpr const size_t list_size = 1 << 16;
 constexpr const size_t line_size = 64;
 
+// arenas move shorter lists, so that small arenas stay small
+constexpr const size_t arena_list_size = 1 << 10;
+
 template <typename T>
 class list_allocator {
-  
+ public:
+  class arena;
+
+ private:
   //union alignas(64) block {
   union block {
     T data;
@@ -61,13 +70,50 @@ class list_allocator {
   };
 
   using block_p = block*;
+
+  // a chunk of memory obtained from the system
+  struct slab {
+    block_p start;
+    size_t num_blocks;
+    pbbs::page_kind kind;
+    slab(block_p start = NULL, size_t num_blocks = 0,
+	 pbbs::page_kind kind = pbbs::normal_pages)
+      : start(start), num_blocks(num_blocks), kind(kind) {}
+    bool operator < (const slab& o) const { return start < o.start; }
+  };
+
+  // The memory and free blocks of one pool.  The static interface works
+  // on a default pool, and each arena has a pool of its own.  Full lists
+  // are kept per NUMA node: a list goes to the stack of the node of the
+  // thread that filled it, and threads take lists from their own node's
+  // stack before trying the others.
+  struct pool {
+    concurrent_stack<slab> roots;
+    concurrent_stack<block_p>* global_stacks;
+    int num_nodes;
+    thread_list* local_lists;
+    size_t list_length;
+    std::atomic<size_t> blocks_allocated;
+    bool is_arena;
+    arena* owner_arena;  // NULL for the default pool
+    pool(size_t list_length, arena* a)
+      : num_nodes(pbbs::numa_num_nodes()), local_lists(NULL),
+	list_length(list_length), blocks_allocated(0), is_arena(a != NULL),
+	owner_arena(a) {
+      global_stacks = new concurrent_stack<block_p>[num_nodes];
+    }
+    ~pool() { delete[] global_stacks; }
+    concurrent_stack<block_p>& local_stack() {
+      return global_stacks[pbbs::numa_current_node() % num_nodes]; }
+  };
     
-  static block_p initialize_list(block_p);
-  static block_p get_list();
+  static block_p initialize_list(pool&, block_p);
+  static block_p get_list(pool&);
 
  public:
   static bool initialized;
-  static T* alloc();
+  // an element from the pool of arena a, or the default pool if NULL
+  static T* alloc(arena* a = NULL);
   static void free(T*);
   static void init(size_t n = default_alloc_size,
 		   bool randomize = 0,
@@ -75,55 +121,152 @@ class list_allocator {
   static void reserve(size_t n = default_alloc_size, bool randomize=false);
   static void finish();
   static size_t block_size () {return _block_size;}
-  static size_t num_allocated_blocks() {return blocks_allocated;}
-  static size_t num_used_blocks();
+  static size_t num_allocated_blocks() {
+    return default_pool.blocks_allocated;}
+  static size_t num_used_blocks() { return num_used(default_pool); }
+
+  // the arena e was allocated from, or NULL for the default pool
+  static arena* arena_of(const T* e) {
+    return arenas_used ? owner((block_p) e)->owner_arena : NULL; }
+
+  // n consecutive elements in fresh memory of the pool of a (as for
+  // alloc), the i-th at slab_element(s, i).  They count as allocated,
+  // and each is freed individually with free().
+  static void* alloc_slab(size_t n, arena* a = NULL) {
+    return allocate_blocks(a ? a->p : default_pool, n); }
+  static T* slab_element(void* s, size_t i) { return &((block_p) s)[i].data; }
+
+  // returns slabs with no element in use to the system
+  static size_t release_free() { return release_free(default_pool); }
+
+  // How slabs allocated from here on are backed.  With huge pages the
+  // pools take memory in slabs of several lists, so that little of the
+  // last huge page is wasted.
+  static void set_page_kind(pbbs::page_kind k) { pages = k; }
 
  private:
   static void rand_shuffle();
-  static concurrent_stack<block_p> pool_roots;
-  static concurrent_stack<block_p> global_stack;
-  static thread_list* local_lists;
+  static pool default_pool;
 
   static int thread_count;
-  static size_t list_length;
   static size_t max_blocks;
   static size_t _block_size;
-  static std::atomic<size_t> blocks_allocated;
-  static block_p allocate_blocks(size_t num_blocks);
+  static pbbs::page_kind pages;
+  static size_t lists_per_slab(const pool&);
+  static block_p allocate_blocks(pool&, size_t num_blocks);
+  static T* alloc_from(pool&);
+  static void free_to(pool&, block_p);
+  static size_t num_used(pool&);
+  static size_t release_free(pool&);
+
+  // Arena memory comes in aligned regions of 2^region_bits bytes, and
+  // owners maps each region to its pool in a two level table indexed by
+  // address, so free() can find the pool of an element.  Regions of the
+  // default pool are not entered, and the table is only consulted once
+  // an arena has been created.
+  static constexpr size_t region_bits = 16;
+  static constexpr size_t table_bits = 16;
+  static constexpr size_t region_size = ((size_t) 1) << region_bits;
+  static bool arenas_used;
+  static std::atomic<std::atomic<pool*>*> owners[1 << table_bits];
+  static pool* owner(block_p);
+  static void set_owner(block_p start, size_t bytes, pool*);
+  static size_t slab_bytes(const pool&, size_t num_blocks);
+  static void free_slab(const pool&, const slab&);
 };
 
-template<typename T> concurrent_stack<typename list_allocator<T>::block_p>
-list_allocator<T>::pool_roots;
+// A separate pool of elements, for example for the maps of one tenant,
+// so that its memory can be accounted for and released on its own.
+// Elements are taken from it by passing it to alloc(), which is safe
+// concurrently with allocation for other arenas or the default pool;
+// free() always returns an element to the pool it came from.  Destroying
+// the arena returns all of its memory to the system at once, without
+// visiting the elements, so nothing allocated from it may be used or
+// freed afterwards.
+template<typename T>
+class list_allocator<T>::arena {
+ public:
+  arena() : p(arena_list_size, this) {
+    init();
+    arenas_used = true;
+    p.local_lists = new thread_list[thread_count];
+  }
+
+  ~arena() {
+    maybe<slab> x;
+    while ((x = p.roots.pop())) free_slab(p, *x);
+    delete[] p.local_lists;
+  }
+
+  size_t num_allocated_blocks() { return p.blocks_allocated; }
+  size_t num_used_blocks() { return num_used(p); }
+
+  // as for the default pool, not safe if run concurrently with alloc and
+  // free on this arena
+  size_t release_free() { return list_allocator<T>::release_free(p); }
+
+ private:
+  friend class list_allocator<T>;
+  pool p;
+};
 
-template<typename T> concurrent_stack<typename list_allocator<T>::block_p>
-list_allocator<T>::global_stack;
+template<typename T> typename list_allocator<T>::pool
+list_allocator<T>::default_pool(list_size, NULL);
 
 template<typename T> bool 
 list_allocator<T>::initialized = false;
 
-template<typename T> typename list_allocator<T>::thread_list*
-list_allocator<T>::local_lists;
-
 template<typename T> int 
 list_allocator<T>::thread_count;
 
-template<typename T> size_t 
-list_allocator<T>::list_length = list_size;
-
 template<typename T> size_t 
 list_allocator<T>::max_blocks;
 
 template<typename T> size_t 
 list_allocator<T>::_block_size;
 
-template<typename T> std::atomic<size_t>
-list_allocator<T>::blocks_allocated;
+template<typename T> bool
+list_allocator<T>::arenas_used = false;
+
+template<typename T> pbbs::page_kind
+list_allocator<T>::pages = pbbs::normal_pages;
+
+template<typename T>
+std::atomic<std::atomic<typename list_allocator<T>::pool*>*>
+list_allocator<T>::owners[1 << table_bits];
+
+// the pool a block belongs to
+template<typename T>
+inline auto list_allocator<T>::owner(block_p b) -> pool* {
+  size_t r = ((size_t) b) >> region_bits;
+  size_t mask = (((size_t) 1) << table_bits) - 1;
+  std::atomic<pool*>* leaf = owners[(r >> table_bits) & mask].load();
+  pool* o = leaf ? leaf[r & mask].load(std::memory_order_relaxed) : NULL;
+  return o ? o : &default_pool;
+}
+
+// records o as the pool of the regions in [start, start + bytes)
+template<typename T>
+void list_allocator<T>::set_owner(block_p start, size_t bytes, pool* o) {
+  size_t mask = (((size_t) 1) << table_bits) - 1;
+  size_t first = ((size_t) start) >> region_bits;
+  for (size_t r = first; r < first + bytes / region_size; r++) {
+    std::atomic<pool*>* leaf = owners[(r >> table_bits) & mask].load();
+    if (leaf == NULL) {
+      std::atomic<pool*>* l = new std::atomic<pool*>[1 << table_bits]();
+      if (owners[(r >> table_bits) & mask].compare_exchange_strong(leaf, l))
+	leaf = l;
+      else delete[] l;  // leaf was set by the winner
+    }
+    leaf[r & mask].store(o);
+  }
+}
 
 // Allocate a new list of list_length elements
 template<typename T>
-auto list_allocator<T>::initialize_list(block_p start) -> block_p {
+auto list_allocator<T>::initialize_list(pool& P, block_p start) -> block_p {
   block_p p = start;
-  block_p end  = start + list_length - 1;
+  block_p end  = start + P.list_length - 1;
 
   while (p != end) {
     p->next = (p + 1);
@@ -134,38 +277,77 @@ auto list_allocator<T>::initialize_list(block_p start) -> block_p {
 }
 
 template<typename T>
-size_t list_allocator<T>::num_used_blocks() {
-  size_t free_blocks = global_stack.size()*list_length;
+size_t list_allocator<T>::num_used(pool& P) {
+  size_t free_blocks = 0;
+  for (int i = 0; i < P.num_nodes; ++i)
+    free_blocks += P.global_stacks[i].size()*P.list_length;
   for (int i = 0; i < thread_count; ++i) 
-    free_blocks += local_lists[i].sz;
-  return blocks_allocated - free_blocks;
+    free_blocks += P.local_lists[i].sz;
+  return P.blocks_allocated - free_blocks;
+}
+
+// bytes taken from the system for a slab of num_blocks blocks; arena
+// slabs cover whole regions
+template<typename T>
+size_t list_allocator<T>::slab_bytes(const pool& P, size_t num_blocks) {
+  size_t align = P.is_arena ? region_size : line_size;
+  size_t bytes = num_blocks * _block_size + line_size;
+  return (bytes + align - 1) / align * align;
 }
 
 template<typename T>
-auto list_allocator<T>::allocate_blocks(size_t num_blocks) -> block_p { 
-  block_p start = (block_p) aligned_alloc(line_size,
-					  num_blocks * _block_size+ line_size);
+auto list_allocator<T>::allocate_blocks(pool& P, size_t num_blocks)
+  -> block_p { 
+  size_t bytes = slab_bytes(P, num_blocks);
+  block_p start = (block_p) pbbs::os_alloc(bytes, P.is_arena ? region_size
+					   : line_size, pages);
   if (start == NULL) {
     fprintf(stderr, "Cannot allocate space in list_allocator");
     exit(1); }
 
-  blocks_allocated += num_blocks; // atomic
-  if (blocks_allocated > max_blocks) {
+  P.blocks_allocated += num_blocks; // atomic
+  if (P.blocks_allocated > max_blocks) {
     fprintf(stderr, "Too many blocks in list_allocator, change max_blocks");
     exit(1);  }
 
-  pool_roots.push(start); // keep track so can free later
+  if (P.is_arena) set_owner(start, bytes, &P);
+  // keep track so can free later
+  P.roots.push(slab(start, num_blocks, pages));
   return start;
 }
 
-// Either grab a list from the global pool, or if there is none
-// then allocate a new list
 template<typename T>
-auto list_allocator<T>::get_list() -> block_p {
-    maybe<block_p> rem = global_stack.pop();
-    if (rem) return *rem;
-    block_p start = allocate_blocks(list_length);
-    return initialize_list(start);
+void list_allocator<T>::free_slab(const pool& P, const slab& s) {
+  size_t bytes = slab_bytes(P, s.num_blocks);
+  if (P.is_arena) set_owner(s.start, bytes, NULL);
+  pbbs::os_free(s.start, bytes, s.kind);
+}
+
+// enough lists to fill a few huge pages with little waste, or whole
+// huge pages for the short lists of arenas
+template<typename T>
+size_t list_allocator<T>::lists_per_slab(const pool& P) {
+  if (pages == pbbs::normal_pages) return 1;
+  size_t target = (P.is_arena ? 1 : 16) * pbbs::huge_page_size;
+  size_t list_bytes = P.list_length * _block_size;
+  return std::max((size_t) 1, (target + list_bytes - 1) / list_bytes);
+}
+
+// Either grab a list from the global pool, preferring the local node,
+// or if there is none then allocate a new list, which the first touch
+// in initialize_list places on the local node
+template<typename T>
+auto list_allocator<T>::get_list(pool& P) -> block_p {
+    int nd = pbbs::numa_current_node();
+    for (int i = 0; i < P.num_nodes; ++i) {
+      maybe<block_p> rem = P.global_stacks[(nd + i) % P.num_nodes].pop();
+      if (rem) return *rem;
+    }
+    size_t m = lists_per_slab(P);
+    block_p start = allocate_blocks(P, m * P.list_length);
+    for (size_t i = 1; i < m; i++)
+      P.local_stack().push(initialize_list(P, start + i * P.list_length));
+    return initialize_list(P, start);
 }
 
 // Randomly orders the free blocks.  Only used for testing.
@@ -177,14 +359,14 @@ void list_allocator<T>::rand_shuffle() {
   // pull all free blocks out
   T** P = new T*[num_free];
   cilk_for (int i=0; i < num_free; i ++)
-    P[i] = alloc();
+    P[i] = alloc_from(default_pool);
 
   // randomly shuffle them
   pbbs::random_shuffle(P,num_free);
 
   // put them back
   cilk_for (int i=0; i < num_free; i ++)
-    free(P[i]);
+    free_to(default_pool, (block_p) P[i]);
   
   delete[] P; 
 }
@@ -194,10 +376,12 @@ template<typename T>
 void list_allocator<T>::reserve(size_t n, bool randomize) {
   if (!initialized) init(n);
   else {
+    size_t list_length = default_pool.list_length;
     size_t num_lists = thread_count + ceil(n / (double)list_length);
-    block_p start = allocate_blocks(list_length*num_lists);
+    block_p start = allocate_blocks(default_pool, list_length*num_lists);
     cilk_for (int i = 0; i < num_lists; ++i) 
-      global_stack.push(initialize_list(start + i*list_length));
+      default_pool.local_stack().push(
+	initialize_list(default_pool, start + i*list_length));
     if (randomize) rand_shuffle();
   }
 }
@@ -207,7 +391,7 @@ void list_allocator<T>::init(size_t n, bool randomize,
 			     size_t _max_blocks) {
     if (initialized) return;
     initialized = true;
-    blocks_allocated = 0;
+    default_pool.blocks_allocated = 0;
     max_blocks = _max_blocks;
     thread_count = __cilkrts_get_nworkers();
 
@@ -220,33 +404,100 @@ void list_allocator<T>::init(size_t n, bool randomize,
     reserve(n, randomize);
 
     // all local lists start out empty
-    local_lists = new thread_list[thread_count];
+    default_pool.local_lists = new thread_list[thread_count];
 }
 
 template<typename T>
 void list_allocator<T>::finish() {
     if (!initialized) return;
 
-    delete[] local_lists;
+    delete[] default_pool.local_lists;
 
-    maybe<block_p> x;
-    while (x = pool_roots.pop()) std::free(*x);
-    pool_roots.clear();
-    global_stack.clear();
+    maybe<slab> x;
+    while (x = default_pool.roots.pop()) free_slab(default_pool, *x);
+    default_pool.roots.clear();
+    for (int i = 0; i < default_pool.num_nodes; ++i)
+      default_pool.global_stacks[i].clear();
 
-    blocks_allocated = 0;
+    default_pool.blocks_allocated = 0;
     initialized = false;
 }
 
+// Frees every slab none of whose elements is in use, and returns the
+// number of elements released.  The other free elements are put back
+// into lists on the global pool.  Not safe if run concurrently with
+// alloc and free.
+template<typename T>
+size_t list_allocator<T>::release_free(pool& P) {
+  if (!initialized) return 0;
+  size_t list_length = P.list_length;
+
+  // pull all free elements out
+  std::vector<block_p> fr;
+  maybe<block_p> l;
+  for (int i = 0; i < P.num_nodes; ++i)
+    while ((l = P.global_stacks[i].pop()))
+      for (block_p p = *l; p != NULL; p = p->next) fr.push_back(p);
+  for (int i = 0; i < thread_count; ++i) {
+    block_p p = P.local_lists[i].head;
+    for (size_t j = 0; j < P.local_lists[i].sz; j++, p = p->next)
+      fr.push_back(p);
+    P.local_lists[i].head = NULL;
+    P.local_lists[i].sz = 0;
+  }
+
+  // count them per slab
+  std::vector<slab> slabs;
+  maybe<slab> x;
+  while ((x = P.roots.pop())) slabs.push_back(*x);
+  std::sort(slabs.begin(), slabs.end());
+  auto slab_of = [&] (block_p p) {
+    return std::upper_bound(slabs.begin(), slabs.end(), slab(p))
+      - slabs.begin() - 1;};
+  std::vector<size_t> cnt(slabs.size(), 0);
+  for (block_p p : fr) cnt[slab_of(p)]++;
+
+  size_t released = 0;
+  for (size_t i = 0; i < slabs.size(); i++) {
+    if (cnt[i] == slabs[i].num_blocks) {
+      free_slab(P, slabs[i]);
+      released += slabs[i].num_blocks;
+    } else P.roots.push(slabs[i]);
+  }
+  P.blocks_allocated -= released;
+
+  // relink the rest into full lists, the remainder going to a local list
+  size_t j = 0;
+  for (block_p p : fr)
+    if (cnt[slab_of(p)] < slabs[slab_of(p)].num_blocks) fr[j++] = p;
+  size_t i = 0;
+  for (; i + list_length <= j; i += list_length) {
+    for (size_t k = i; k < i + list_length - 1; k++) fr[k]->next = fr[k+1];
+    fr[i + list_length - 1]->next = NULL;
+    P.local_stack().push(fr[i]);
+  }
+  for (size_t k = i; k < j; k++) fr[k]->next = (k + 1 < j) ? fr[k+1] : NULL;
+  P.local_lists[0].head = (i < j) ? fr[i] : NULL;
+  P.local_lists[0].sz = j - i;
+  return released;
+}
+
 template<typename T>
-void list_allocator<T>::free(T* node) {
-    block_p new_node = (block_p) node;
+inline void list_allocator<T>::free(T* node) {
+    block_p b = (block_p) node;
+    free_to(arenas_used ? *owner(b) : default_pool, b);
+}
+
+template<typename T>
+void list_allocator<T>::free_to(pool& P, block_p new_node) {
     int id = __cilkrts_get_worker_number();
+    size_t list_length = P.list_length;
+    thread_list* local_lists = P.local_lists;
 
     if (local_lists[id].sz == list_length+1) {
       local_lists[id].mid = local_lists[id].head;
     } else if (local_lists[id].sz == 2*list_length) {
-        global_stack.push(local_lists[id].mid->next);
+        P.local_stack().push(local_lists[id].mid->next);
         local_lists[id].mid->next = NULL;
         local_lists[id].sz = list_length;
     }
@@ -257,12 +508,18 @@ void list_allocator<T>::free(T* node) {
 }
 
 template<typename T>
-inline T* list_allocator<T>::alloc() {
+inline T* list_allocator<T>::alloc(arena* a) {
+  return alloc_from(a ? a->p : default_pool);
+}
+
+template<typename T>
+inline T* list_allocator<T>::alloc_from(pool& P) {
     int id = __cilkrts_get_worker_number();
+    thread_list* local_lists = P.local_lists;
 
     if (!local_lists[id].sz)  {
-      local_lists[id].head = get_list();
-      local_lists[id].sz = list_length;
+      local_lists[id].head = get_list(P);
+      local_lists[id].sz = P.list_length;
     }
 
     local_lists[id].sz--;
@@ -271,4 +528,3 @@ inline T* list_allocator<T>::alloc() {
 
     return &p->data;
 }
-
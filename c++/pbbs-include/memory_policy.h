@@ -0,0 +1,132 @@
+// Memory from the operating system, and its placement on NUMA nodes
+#pragma once
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace pbbs {
+
+  // Parses a sysfs list such as "0-3,8-11", calling f on each number.
+  template <class F>
+  inline void parse_id_list(const char* path, const F& f) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) return;
+    int lo, hi;
+    while (fscanf(fp, "%d", &lo) == 1) {
+      hi = lo;
+      int c = fgetc(fp);
+      if (c == '-') {
+	if (fscanf(fp, "%d", &hi) != 1) break;
+	c = fgetc(fp);
+      }
+      for (int i = lo; i <= hi; i++) f(i);
+      if (c != ',') break;
+    }
+    fclose(fp);
+  }
+
+  // The number of NUMA nodes, 1 if the topology is not available.
+  inline int numa_num_nodes() {
+    static int n = [] () {
+      int m = 0;
+      parse_id_list("/sys/devices/system/node/online",
+		    [&] (int i) { if (i + 1 > m) m = i + 1; });
+      return m > 0 ? m : 1;
+    }();
+    return n;
+  }
+
+  inline int numa_node_of_cpu(int cpu) {
+    static std::vector<int> node_of = [] () {
+      std::vector<int> r;
+      char path[64];
+      for (int nd = 0; nd < numa_num_nodes(); nd++) {
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/node/node%d/cpulist", nd);
+	parse_id_list(path, [&] (int c) {
+	    if (c >= (int) r.size()) r.resize(c + 1, 0);
+	    r[c] = nd; });
+      }
+      return r;
+    }();
+    return (cpu >= 0 && cpu < (int) node_of.size()) ? node_of[cpu] : 0;
+  }
+
+  // the node of the cpu the calling thread is running on
+  inline int numa_current_node() {
+    if (numa_num_nodes() == 1) return 0;
+    return numa_node_of_cpu(sched_getcpu());
+  }
+
+  // Asks for the pages of [p, p + bytes) to be spread round robin over
+  // all nodes when first touched.  Best effort: does nothing if the
+  // system does not support it.
+  inline void numa_interleave(void* p, size_t bytes) {
+    int n = numa_num_nodes();
+    if (n == 1 || bytes == 0) return;
+    const int mpol_interleave = 3;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t) p / page * page;
+    size_t end = ((size_t) p + bytes + page - 1) / page * page;
+    const size_t word = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(n / word + 1, 0);
+    for (int i = 0; i < n; i++) mask[i / word] |= 1UL << (i % word);
+    syscall(SYS_mbind, start, end - start, mpol_interleave, mask.data(),
+	    mask.size() * word, 0);
+  }
+
+  // How mapped memory is backed.  Transparent huge pages are asked for
+  // with madvise and depend on the system's THP setting; explicit huge
+  // pages come from the hugetlbfs pool, falling back to transparent ones
+  // when the pool is empty.
+  enum page_kind {normal_pages, transparent_huge_pages, explicit_huge_pages};
+
+  constexpr size_t huge_page_size = ((size_t) 1) << 21;
+
+  // the size in bytes os_alloc maps for a request of bytes
+  inline size_t os_alloc_size(size_t bytes, page_kind kind) {
+    size_t page = (kind == normal_pages) ? sysconf(_SC_PAGESIZE)
+                                         : huge_page_size;
+    return (bytes + page - 1) / page * page;
+  }
+
+  // Maps bytes of fresh memory aligned to align (a power of two), given
+  // back with os_free.  Unlike malloc memory (see utils.h) it is returned
+  // to the system when freed, and its pages are placed on first touch.
+  inline void* os_alloc(size_t bytes, size_t align,
+			page_kind kind = normal_pages) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    bytes = os_alloc_size(bytes, kind);
+#ifdef MAP_HUGETLB
+    if (kind == explicit_huge_pages && align <= huge_page_size) {
+      void* h = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (h != MAP_FAILED) return h;
+    }
+#endif
+    if (kind != normal_pages && align < huge_page_size) align = huge_page_size;
+    if (align < page) align = page;
+    char* p = (char*) mmap(NULL, bytes + align - page, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == (char*) MAP_FAILED) return NULL;
+    // trim to an aligned range
+    char* a = (char*) (((size_t) p + align - 1) / align * align);
+    char* end = p + bytes + align - page;
+    if (a > p) munmap(p, a - p);
+    if (end > a + bytes) munmap(a + bytes, end - (a + bytes));
+#ifdef MADV_HUGEPAGE
+    if (kind != normal_pages) madvise(a, bytes, MADV_HUGEPAGE);
+#endif
+    return a;
+  }
+
+  // bytes and kind as given to os_alloc
+  inline void os_free(void* p, size_t bytes, page_kind kind = normal_pages) {
+    munmap(p, os_alloc_size(bytes, kind));
+  }
+}
@@ -112,8 +112,16 @@ namespace pbbs {
     return __sync_bool_compare_and_swap(ptr, oldv, newv);
   }
 
+  // integers use a single atomic add instead of a CAS loop
   template <typename E, typename EV>
-  inline E fetch_and_add(E *a, EV b) {
+  inline typename std::enable_if<std::is_integral<E>::value, E>::type
+  fetch_and_add(E *a, EV b) {
+    return __sync_fetch_and_add(a, (E) b);
+  }
+
+  template <typename E, typename EV>
+  inline typename std::enable_if<!std::is_integral<E>::value, E>::type
+  fetch_and_add(E *a, EV b) {
     volatile E newV, oldV; 
     do {oldV = *a; newV = oldV + b;}
     while (!CAS_GCC(a, oldV, newV));
@@ -121,7 +129,14 @@ namespace pbbs {
   }
 
   template <typename E, typename EV>
-  inline void write_add(E *a, EV b) {
+  inline typename std::enable_if<std::is_integral<E>::value>::type
+  write_add(E *a, EV b) {
+    __sync_fetch_and_add(a, (E) b);
+  }
+
+  template <typename E, typename EV>
+  inline typename std::enable_if<!std::is_integral<E>::value>::type
+  write_add(E *a, EV b) {
     volatile E newV, oldV; 
     do {oldV = *a; newV = oldV + b;}
     while (!CAS_GCC(a, oldV, newV));
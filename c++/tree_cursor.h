@@ -0,0 +1,151 @@
+// In-order cursor over a tree
+#pragma once
+
+#include <vector>
+#include "abstract_node.h"
+
+// Keeps the path from the root to the current node on an explicit stack
+// so that next() and prev() take O(1) amortized time.  Inside a leaf
+// block the cursor keeps an index into the block's entries, which are
+// decoded once on entering an encoded block.
+//
+// The cursor does not hold a reference to the tree: the tree must not be
+// freed while the cursor is in use.  Since maps are persistent, iterate
+// over a copy of the map to get a stable snapshot.
+template<class Node>
+class tree_cursor {
+ public:
+  using K = typename Node::key_type;
+  using V = typename Node::value_type;
+  using E = typename Node::entry_type;
+  using key_compare = typename Node::key_compare;
+
+  tree_cursor(Node* root) : root(root), blk(NULL), idx(0) {}
+
+  bool valid() const { return !path.empty(); }
+
+  K get_key() const {
+    return cur()->is_block ? blk[idx].first : cur()->get_key(); }
+  V get_value() const {
+    return cur()->is_block ? blk[idx].second : cur()->get_value(); }
+  E get_entry() const {
+    return cur()->is_block ? blk[idx] : cur()->get_entry(); }
+
+  // position at the smallest entry
+  void seek_first() {
+    path.clear();
+    if (root) push_leftmost(root);
+  }
+
+  // position at the largest entry
+  void seek_last() {
+    path.clear();
+    if (root) push_rightmost(root);
+  }
+
+  // position at the first entry with key not less than k,
+  // invalid if there is none
+  void seek(const K& k) {
+    path.clear();
+    size_t found = 0; // depth of the last node whose key was >= k
+    Node* t = root;
+    while (t) {
+      path.push_back(t);
+      if (t->is_block) {
+        enter_block();
+        while (idx < t->block_size() && comp(blk[idx].first, k)) idx++;
+        if (idx < t->block_size()) return;
+        break;
+      }
+      if (comp(t->get_key(), k)) t = t->rc;
+      else { found = path.size(); t = t->lc; }
+    }
+    path.resize(found);
+  }
+
+  // position at the entry with rank r (0 based), invalid if r >= size
+  void seek_rank(size_t r) {
+    path.clear();
+    Node* t = root;
+    while (t) {
+      path.push_back(t);
+      if (t->is_block) {
+        if (r < t->block_size()) { enter_block(); idx = r; return; }
+        break;
+      }
+      size_t left_size = get_node_count(t->lc);
+      if (r < left_size) t = t->lc;
+      else if (r == left_size) return;
+      else { r -= left_size + 1; t = t->rc; }
+    }
+    path.clear();
+  }
+
+  // advance to the next entry, becoming invalid past the last one
+  void next() {
+    Node* t = cur();
+    if (t->is_block && idx + 1 < t->block_size()) { idx++; return; }
+    if (!t->is_block && t->rc) { push_leftmost(t->rc); return; }
+    // climb until we leave a left subtree
+    path.pop_back();
+    while (!path.empty() && cur()->rc == t) {
+      t = cur();
+      path.pop_back();
+    }
+  }
+
+  // step back to the previous entry, becoming invalid before the first
+  void prev() {
+    Node* t = cur();
+    if (t->is_block && idx > 0) { idx--; return; }
+    if (!t->is_block && t->lc) { push_rightmost(t->lc); return; }
+    // climb until we leave a right subtree
+    path.pop_back();
+    while (!path.empty() && cur()->lc == t) {
+      t = cur();
+      path.pop_back();
+    }
+  }
+
+ private:
+  Node* cur() const { return path.back(); }
+
+  void push_leftmost(Node* t) {
+    while (true) {
+      path.push_back(t);
+      if (t->is_block) { enter_block(); idx = 0; return; }
+      if (!t->lc) return;
+      t = t->lc;
+    }
+  }
+
+  void push_rightmost(Node* t) {
+    while (true) {
+      path.push_back(t);
+      if (t->is_block) { enter_block(); idx = t->block_size() - 1; return; }
+      if (!t->rc) return;
+      t = t->rc;
+    }
+  }
+
+  // makes blk point to the entries of the block on top of the path
+  void enter_block() {
+    Node* t = cur();
+    idx = 0;
+    blk = Node::block_type::array(t->block);
+    if (blk == NULL) {
+      buf.clear();
+      typename Node::block_iterator it = t->block_begin();
+      for (size_t i = 0; i < t->block_size(); i++, ++it) buf.push_back(*it);
+      blk = buf.data();
+    }
+  }
+
+  static bool comp(const K& a, const K& b) { return key_compare()(a, b); }
+
+  Node* root;
+  std::vector<Node*> path;
+  const E* blk;  // entries of the block on top of the path
+  size_t idx;    // position within that block
+  std::vector<E> buf;
+};
@@ -4,6 +4,10 @@
 #include "abstract_node.h"
 #include "pbbs-include/binary_search.h"
 #include "pbbs-include/sample_sort.h"
+#include <vector>
+#include <atomic>
+
+class page_store;
 
 template<class Node>
 struct tree_operations {
@@ -15,6 +19,8 @@ struct tree_operations {
   using key_compare = typename Node::key_compare;
   using aug_type    = typename Node::aug_type;
   using aug_class   = typename Node::aug_class;
+  using allocator   = typename Node::allocator;
+  using arena       = typename Node::arena;
   
   static Node* t_join3(Node* b1, Node* b2, Node* k) {
       return tree_type::t_join(b1, b2, k);
@@ -45,8 +51,131 @@ struct tree_operations {
       bool removed;
   };
 
+  using block_iterator = typename Node::block_iterator;
+  using entry_iterator = array_iter<K,V>;
+  using key_iterator   = key_iter<K,V>;
+  using batch_type     = batch_op<K,V>;
+
+  // index of the first entry in leaf block b with key not less than k
+  // (binary search on plain blocks, a decoding scan on encoded ones)
+  static size_t block_lower(const Node* b, const K& k) {
+      const E* A = Node::block_type::array(b->block);
+      size_t lo = 0, hi = b->block_size();
+      if (A == NULL) {
+          block_iterator it = b->block_begin();
+          while (lo < hi && comp(it.key(), k)) { ++it; ++lo; }
+          return lo;
+      }
+      while (lo < hi) {
+          size_t mid = (lo + hi)/2;
+          if (comp(A[mid].first, k)) lo = mid + 1;
+          else hi = mid;
+      }
+      return lo;
+  }
+
+  // index of the first entry in leaf block b with key greater than k
+  static size_t block_upper(const Node* b, const K& k) {
+      const E* A = Node::block_type::array(b->block);
+      size_t lo = 0, hi = b->block_size();
+      if (A == NULL) {
+          block_iterator it = b->block_begin();
+          while (lo < hi && !comp(k, it.key())) { ++it; ++lo; }
+          return lo;
+      }
+      while (lo < hi) {
+          size_t mid = (lo + hi)/2;
+          if (comp(k, A[mid].first)) hi = mid;
+          else lo = mid + 1;
+      }
+      return lo;
+  }
+
+  // the i'th entry of leaf block b
+  static E block_entry(const Node* b, size_t i) {
+      const E* A = Node::block_type::array(b->block);
+      if (A != NULL) return A[i];
+      block_iterator it = b->block_begin();
+      for (size_t j = 0; j < i; j++) ++it;
+      return *it;
+  }
+
+  // combined augmented value of entries [i, j) of leaf block b, i < j
+  static aug_type block_aug(const Node* b, size_t i, size_t j) {
+      block_iterator it = b->block_begin();
+      for (size_t k = 0; k < i; k++) ++it;
+      aug_type ret = aug_class::from_entry(it.key(), it.value());
+      for (size_t k = i+1; k < j; k++) {
+          ++it;
+          ret = aug_class::combine(ret, aug_class::from_entry(it.key(), it.value()));
+      }
+      return ret;
+  }
+
+  // Sequentially merges two sorted runs into a new tree in arena a,
+  // decoding as it goes.  Keys only in A, only in B, or in both are kept
+  // according to the three flags; for keys in both the value is
+  // op(value in A, value in B).
+  template <class IterA, class IterB, class BinaryOp>
+  static Node* merge_entries(IterA A, size_t na, IterB B, size_t nb,
+                             const BinaryOp& op,
+                             bool keep_a, bool keep_both, bool keep_b,
+                             arena* a) {
+      E* out = pbbs::new_array_no_init<E>(na + nb);
+      size_t i = 0, j = 0, k = 0;
+      while (i < na && j < nb) {
+          if (comp(A.key(), B.key())) {
+              if (keep_a) pbbs::assign_uninitialized(out[k++], E(*A));
+              ++A; i++;
+          } else if (comp(B.key(), A.key())) {
+              if (keep_b) pbbs::assign_uninitialized(out[k++], E(*B));
+              ++B; j++;
+          } else {
+              if (keep_both) pbbs::assign_uninitialized(out[k++],
+                               E(B.key(), op(A.value(), B.value())));
+              ++A; ++B; i++; j++;
+          }
+      }
+      if (keep_a) for (; i < na; i++, ++A) pbbs::assign_uninitialized(out[k++], E(*A));
+      if (keep_b) for (; j < nb; j++, ++B) pbbs::assign_uninitialized(out[k++], E(*B));
+      Node* r = t_from_sorted_array(out, k, a);
+      pbbs::delete_array(out, k);
+      return r;
+  }
+
+  // merges two leaf blocks, consuming both
+  template <class BinaryOp>
+  static Node* merge_blocks(Node* b1, Node* b2, const BinaryOp& op,
+                            bool keep_a, bool keep_both, bool keep_b) {
+      Node* r = merge_entries(b1->block_begin(), b1->block_size(),
+                              b2->block_begin(), b2->block_size(),
+                              op, keep_a, keep_both, keep_b,
+                              allocator::arena_of(b1));
+      decrease(b1);
+      decrease(b2);
+      return r;
+  }
+
+  static split_info split_block(Node* b, const K& e) {
+      size_t n = b->block_size();
+      split_info ret(NULL, NULL, false);
+      {
+          block_array<Node> B(b);
+          arena* a = allocator::arena_of(b);
+          size_t i = block_lower(b, e);
+          bool found = (i < n) && !comp(e, B[i].first);
+          ret.first = Node::make_block(B.A, i, a);
+          ret.second = Node::make_block(B.A+i+found, n-i-found, a);
+          ret.removed = found;
+          if (found) ret.value = B[i].second;
+      }
+      decrease(b);
+      return ret;
+  }
+
   static split_info t_split(Node* bst, const K& e) {
       if (!bst) return split_info(NULL, NULL, false);
+      if (bst->is_block) return split_block(bst, e);
       
       Node* lsub = bst->lc, *rsub = bst->rc; 
       const K key = bst->get_key();
@@ -72,6 +201,7 @@ struct tree_operations {
   }
 
   static Node* t_range(Node* b, const K& low, const K& high) {
+      arena* a = b ? allocator::arena_of(b) : NULL;
       split_info left_split = t_split(b, low);
       decrease_recursive(left_split.first);
   
@@ -80,9 +210,9 @@ struct tree_operations {
 
       Node* ret = right_split.first;
       if (left_split.removed)
-            ret = t_insert(ret, E(low,left_split.value));
+            ret = t_insert(ret, E(low,left_split.value), a);
       if (right_split.removed)
-            ret = t_insert(ret, E(high,right_split.value));
+            ret = t_insert(ret, E(high,right_split.value), a);
   
       return ret;
   }
@@ -90,8 +220,11 @@ struct tree_operations {
   static Node* t_join2(Node* b1, Node* b2) {
       if (!b1) return b2;
       if (!b2) return b1;
+      if (b1->is_block && b2->is_block
+          && b1->block_size() + b2->block_size() <= leaf_size)
+          return merge_blocks(b1, b2, get_left<V>(), 1, 1, 1);
       
-      if (b1->rank > b2->rank) {
+      if (get_size_hint(b1) > get_size_hint(b2)) {
           Node* join = copy_if_needed(b1);
           return t_join3(join->lc, t_join2(join->rc, b2), join);
        } else {
@@ -104,14 +237,21 @@ struct tree_operations {
   static Node* t_union(Node* b1, Node* b2, const BinaryOp& op) {
       if (!b1) return b2;
       if (!b2) return b1;
+      // a subtree shared by both inputs is its own union (intersection)
+      if (b1 == b2 && is_idempotent<BinaryOp>::value) {
+          decrease(b2);
+          return b1;
+      }
+      if (b1->is_block && b2->is_block)
+          return merge_blocks(b1, b2, op, 1, 1, 1);
 
+      size_t mn = std::min(get_size_hint(b1),get_size_hint(b2));
       Node* join = copy_if_needed(b2);
 
       split_info bsts = t_split(b1, join->get_key());
       if (bsts.removed)
           join->set_value(op(bsts.value, join->get_value()));
 
-      size_t mn = std::min(get_node_count(b1),get_node_count(b2));
       auto P = fork<Node*>(mn >= node_limit,
         [&] () {return t_union(bsts.first, join->lc, op);},
         [&] () {return t_union(bsts.second, join->rc, op);});
@@ -129,12 +269,19 @@ struct tree_operations {
           decrease_recursive(b1);
           return NULL;
       }
+      // a subtree shared by both inputs is its own union (intersection)
+      if (b1 == b2 && is_idempotent<BinaryOp>::value) {
+          decrease(b2);
+          return b1;
+      }
+      if (b1->is_block && b2->is_block)
+          return merge_blocks(b1, b2, op, 0, 1, 0);
 
+      size_t mn = std::min(get_size_hint(b1),get_size_hint(b2));
       Node* join = copy_if_needed(b2);
 
       split_info bsts = t_split(b1, join->get_key());
 
-      size_t mn = std::min(get_node_count(b1),get_node_count(b2));
       auto P = fork<Node*>(mn >= node_limit,
         [&]() {return t_intersect(bsts.first, join->lc, op);},
         [&]() {return t_intersect(bsts.second, join->rc, op);}
@@ -155,12 +302,20 @@ struct tree_operations {
           return NULL;
       }
       if (!b2) return b1;
+      // a subtree shared by both inputs is removed entirely
+      if (b1 == b2) {
+          decrease_recursive(b1);
+          decrease_recursive(b2);
+          return NULL;
+      }
+      if (b1->is_block && b2->is_block)
+          return merge_blocks(b1, b2, get_left<V>(), 1, 0, 0);
 
+      size_t mn = std::min(get_size_hint(b1),get_size_hint(b2));
       Node* join = copy_if_needed(b1);
       
-      split_info bsts = t_split(b2, b1->get_key());
+      split_info bsts = t_split(b2, join->get_key());
 
-      size_t mn = std::min(get_node_count(b1),get_node_count(b2));
       auto P = fork<Node*>(mn >= node_limit,
       [&]() {return t_difference(join->lc, bsts.first);},
         [&]() {return t_difference(join->rc, bsts.second);});
@@ -177,14 +332,28 @@ struct tree_operations {
   static Node* t_filter(Node* b, const Func& f) {
       if (!b) return NULL;
 
+      if (b->is_block) {
+          size_t n = b->block_size(), k = 0;
+          E* out = pbbs::new_array_no_init<E>(n);
+          block_iterator it = b->block_begin();
+          for (size_t i = 0; i < n; i++, ++it) {
+              E x = *it;
+              if (f(x)) pbbs::assign_uninitialized(out[k++], x);
+          }
+          Node* r = t_from_sorted_array(out, k, allocator::arena_of(b));
+          pbbs::delete_array(out, k);
+          decrease(b);
+          return r;
+      }
+
+      size_t mn = get_size_hint(b);
       Node* join = copy_if_needed(b);
 
-      size_t mn = get_node_count(b);
       auto P = fork<Node*>(mn >= node_limit,
         [&]() {return t_filter(join->lc, f);},
         [&]() {return t_filter(join->rc, f);});
 
-      if (f(b->get_entry())) {
+      if (f(join->get_entry())) {
           return t_join3(P.first, P.second, join);
       } else {
           decrease(join);
@@ -192,15 +361,24 @@ struct tree_operations {
       }
   }
 
-  static Node* t_insert(Node* b, const E& e){
-      if (!b) return new Node(e);
+  // new nodes go in arena a
+  static Node* t_insert(Node* b, const E& e, arena* a){
+      if (!b) return new (a) Node(e);
+
+      if (b->is_block) {
+          Node* r = merge_entries(entry_iterator(&e), 1,
+                                  b->block_begin(), b->block_size(),
+                                  get_left<V>(), 1, 1, 1, a);
+          decrease(b);
+          return r;
+      }
 
       Node* tmp = copy_if_needed(b);
 
-      if (comp(b->get_key(), e.first) )
-          return t_join3(tmp->lc,t_insert(tmp->rc, e), tmp);
-      else if (comp(e.first, b->get_key()) )
-          return t_join3(t_insert(tmp->lc, e), tmp->rc, tmp);
+      if (comp(tmp->get_key(), e.first) )
+          return t_join3(tmp->lc,t_insert(tmp->rc, e, a), tmp);
+      else if (comp(e.first, tmp->get_key()) )
+          return t_join3(t_insert(tmp->lc, e, a), tmp->rc, tmp);
       else {
           tmp->set_value(e.second);
           tmp->update();
@@ -210,12 +388,26 @@ struct tree_operations {
 
   inline static Node* t_delete(Node* b, const K& k) {
       if (!b) return NULL;
+
+      if (b->is_block) {
+          size_t n = b->block_size();
+          size_t i = block_lower(b, k);
+          if (i == n || comp(k, block_entry(b, i).first)) return b;
+          E* out = pbbs::new_array_no_init<E>(n-1);
+          block_iterator it = b->block_begin();
+          for (size_t j = 0; j < n; j++, ++it)
+              if (j != i) pbbs::assign_uninitialized(out[j - (j > i)], *it);
+          Node* r = t_from_sorted_array(out, n-1, allocator::arena_of(b));
+          pbbs::delete_array(out, n-1);
+          decrease(b);
+          return r;
+      }
         
       Node* tmp = copy_if_needed(b);
 
-      if (comp(b->get_key(), k)) 
+      if (comp(tmp->get_key(), k)) 
           return t_join3(tmp->lc, t_delete(tmp->rc, k), tmp);
-      else if (comp(k, b->get_key())) 
+      else if (comp(k, tmp->get_key())) 
           return t_join3(t_delete(tmp->lc, k), tmp->rc, tmp);
       else {
           Node* r = t_join2(tmp->lc, tmp->rc);
@@ -224,47 +416,284 @@ struct tree_operations {
       }
   }
 
-    // Assumes the input is sorted and there are no duplicate keys
-  static Node* t_from_sorted_array(E* A, size_t n) {
+    // Assumes the input is sorted and there are no duplicate keys.
+    // The nodes are allocated in arena a.
+  static Node* t_from_sorted_array(E* A, size_t n, arena* a) {
       if (n <= 0) return NULL;
-      if (n == 1) return new Node(A[0]);
+      if (n == 1) return new (a) Node(A[0]);
+      if (n <= leaf_size) return Node::make_block(A, n, a);
 
       size_t mid = n/2;
-      Node* m = new Node(A[mid]);
+      Node* m = new (a) Node(A[mid]);
 
       auto P = fork<Node*>(n >= node_limit,
-      [&]() {return t_from_sorted_array(A, mid);},
-      [&]() {return t_from_sorted_array(A+mid+1, n-mid-1);});
+      [&]() {return t_from_sorted_array(A, mid, a);},
+      [&]() {return t_from_sorted_array(A+mid+1, n-mid-1, a);});
 
       return t_join3(P.first, P.second, m);
   }
 
-  // assumes array A is of lenght n and is sorted with no duplicates
+  // assumes array A is of lenght n and is sorted with no duplicates,
+  // new nodes go in arena a
   template <class BinaryOp>
-  static Node* t_multi_insert_rec(Node* b, E* A, size_t n,const BinaryOp& op) {
-      if (!b) return t_from_sorted_array(A,n);
+  static Node* t_multi_insert_rec(Node* b, E* A, size_t n,const BinaryOp& op,
+                                  arena* a) {
+      if (!b) return t_from_sorted_array(A,n,a);
       if (n == 0) return b;
 
+      if (b->is_block) {
+          Node* r = merge_entries(entry_iterator(A), n,
+                                  b->block_begin(), b->block_size(),
+                                  op, 1, 1, 1, a);
+          decrease(b);
+          return r;
+      }
+
+      size_t mn = get_size_hint(b);
       Node* join = copy_if_needed(b);
 
       auto less_first = [] (E a, E b) -> bool {
         return comp(a.first,b.first);};
       V x;
-      E b_entry = std::make_pair(b->get_key(),x);
+      E b_entry = std::make_pair(join->get_key(),x);
       size_t mid = pbbs::binary_search(make_array_imap(A, n), 
 				       b_entry, less_first);
-      bool dup = (mid < n) && less_first(b_entry,A[mid]);
+      bool dup = (mid < n) && !less_first(b_entry,A[mid]);
       if (dup) join->set_value(op(A[mid].second, join->get_value()));
       
-      size_t mn = get_node_count(b);
       auto P = fork<Node*>(mn >= node_limit,
-      [&] () {return t_multi_insert_rec(join->lc, A, mid, op);},
+      [&] () {return t_multi_insert_rec(join->lc, A, mid, op, a);},
       [&] () {return t_multi_insert_rec(join->rc, A+mid+dup,
-                  n-mid-dup, op);});
+                  n-mid-dup, op, a);});
       
       return t_join3(P.first, P.second, join);
   }
 
+  // removes the keys in A, which is sorted and may hold duplicates
+  static Node* t_multi_delete(Node* b, K* A, size_t n) {
+      if (!b) return NULL;
+      if (n == 0) return b;
+
+      if (b->is_block) {
+          Node* r = merge_entries(key_iterator(A), n,
+                                  b->block_begin(), b->block_size(),
+                                  get_left<V>(), 0, 0, 1,
+                                  allocator::arena_of(b));
+          decrease(b);
+          return r;
+      }
+
+      size_t mn = get_size_hint(b);
+      Node* join = copy_if_needed(b);
+
+      auto less = [] (K a, K b) -> bool { return comp(a, b);};
+      size_t mid = pbbs::binary_search(make_array_imap(A, n),
+				       join->get_key(), less);
+      size_t end = mid;
+      while (end < n && !comp(join->get_key(), A[end])) end++;
+
+      auto P = fork<Node*>(mn >= node_limit,
+      [&] () {return t_multi_delete(join->lc, A, mid);},
+      [&] () {return t_multi_delete(join->rc, A+end, n-end);});
+
+      if (end > mid) {
+          decrease(join);
+          return t_join2(P.first, P.second);
+      }
+      return t_join3(P.first, P.second, join);
+  }
+
+  // for each key in A already in the tree sets its value to
+  // op(value in A, current value), other keys in A are ignored.
+  // assumes A is sorted with no duplicates
+  template <class BinaryOp>
+  static Node* t_multi_update(Node* b, E* A, size_t n, const BinaryOp& op) {
+      if (!b) return NULL;
+      if (n == 0) return b;
+
+      if (b->is_block) {
+          Node* r = merge_entries(entry_iterator(A), n,
+                                  b->block_begin(), b->block_size(),
+                                  op, 0, 1, 1, allocator::arena_of(b));
+          decrease(b);
+          return r;
+      }
+
+      size_t mn = get_size_hint(b);
+      Node* join = copy_if_needed(b);
+
+      auto less_first = [] (E a, E b) -> bool {
+        return comp(a.first,b.first);};
+      V x;
+      E b_entry = std::make_pair(join->get_key(),x);
+      size_t mid = pbbs::binary_search(make_array_imap(A, n), 
+				       b_entry, less_first);
+      bool dup = (mid < n) && !less_first(b_entry,A[mid]);
+      if (dup) join->set_value(op(A[mid].second, join->get_value()));
+
+      auto P = fork<Node*>(mn >= node_limit,
+      [&] () {return t_multi_update(join->lc, A, mid, op);},
+      [&] () {return t_multi_update(join->rc, A+mid+dup,
+                  n-mid-dup, op);});
+
+      return t_join3(P.first, P.second, join);
+  }
+
+  // tree of the entries added by the batch A when applied to an empty
+  // tree, in arena a, assumes A is sorted with no duplicate keys
+  static Node* batch_from_sorted(batch_type* A, size_t n, arena* a) {
+      if (n < node_limit) {
+          E* out = pbbs::new_array_no_init<E>(n);
+          size_t k = 0;
+          for (size_t i = 0; i < n; i++)
+              if (A[i].kind != batch_remove)
+                  pbbs::assign_uninitialized(out[k++], E(A[i].key, A[i].value));
+          Node* r = t_from_sorted_array(out, k, a);
+          pbbs::delete_array(out, k);
+          return r;
+      }
+
+      size_t mid = n/2;
+      auto P = fork<Node*>(true,
+      [&]() {return batch_from_sorted(A, mid, a);},
+      [&]() {return batch_from_sorted(A+mid+1, n-mid-1, a);});
+
+      if (A[mid].kind == batch_remove) return t_join2(P.first, P.second);
+      return t_join3(P.first, P.second,
+                     new (a) Node(E(A[mid].key, A[mid].value)));
+  }
+
+  // applies the batch A to leaf block b, consuming b
+  static Node* batch_block(Node* b, batch_type* A, size_t n) {
+      size_t nb = b->block_size();
+      E* out = pbbs::new_array_no_init<E>(n + nb);
+      block_iterator B = b->block_begin();
+      size_t i = 0, j = 0, k = 0;
+      while (i < n || j < nb) {
+          if (j == nb || (i < n && comp(A[i].key, B.key()))) {
+              if (A[i].kind != batch_remove)
+                  pbbs::assign_uninitialized(out[k++], E(A[i].key, A[i].value));
+              i++;
+          } else if (i == n || comp(B.key(), A[i].key)) {
+              pbbs::assign_uninitialized(out[k++], E(*B));
+              ++B; j++;
+          } else {
+              if (A[i].kind == batch_upsert)
+                  pbbs::assign_uninitialized(out[k++], E(A[i].key, A[i].value));
+              else if (A[i].kind == batch_insert)
+                  pbbs::assign_uninitialized(out[k++], E(*B));
+              ++B; i++; j++;
+          }
+      }
+      Node* r = t_from_sorted_array(out, k, allocator::arena_of(b));
+      pbbs::delete_array(out, k);
+      decrease(b);
+      return r;
+  }
+
+  // applies the inserts, upserts and removes in A in one traversal,
+  // assumes A is sorted with no duplicate keys.  New nodes go in arena a.
+  static Node* t_apply_batch(Node* b, batch_type* A, size_t n, arena* a) {
+      if (n == 0) return b;
+      if (!b) return batch_from_sorted(A, n, a);
+      if (b->is_block) return batch_block(b, A, n);
+
+      size_t mn = get_size_hint(b);
+      Node* join = copy_if_needed(b);
+
+      auto less = [] (const batch_type& a, const batch_type& b) -> bool {
+        return comp(a.key, b.key);};
+      size_t mid = pbbs::binary_search(make_array_imap(A, n),
+				       batch_type(batch_insert, join->get_key()),
+				       less);
+      bool dup = (mid < n) && !comp(join->get_key(), A[mid].key);
+      if (dup && A[mid].kind == batch_upsert) join->set_value(A[mid].value);
+
+      auto P = fork<Node*>(mn >= node_limit,
+      [&] () {return t_apply_batch(join->lc, A, mid, a);},
+      [&] () {return t_apply_batch(join->rc, A+mid+dup, n-mid-dup, a);});
+
+      if (dup && A[mid].kind == batch_remove) {
+          decrease(join);
+          return t_join2(P.first, P.second);
+      }
+      return t_join3(P.first, P.second, join);
+  }
+
+  // An entry still to be visited by t_diff, or with t set a whole
+  // subtree still to be visited
+  struct diff_item {
+      diff_item(Node* t) : t(t) {}
+      diff_item(const E& e) : t(NULL), e(e) {}
+      Node* t;
+      E e;
+  };
+
+  // replaces the subtree on top of S by its root entry and children
+  static void diff_expand(std::vector<diff_item>& S) {
+      Node* t = S.back().t;
+      S.pop_back();
+      if (t->is_block) {
+          block_array<Node> B(t);
+          for (size_t i = t->block_size(); i > 0; i--)
+              S.push_back(diff_item(B[i-1]));
+          return;
+      }
+      if (t->rc) S.push_back(diff_item(t->rc));
+      S.push_back(diff_item(t->get_entry()));
+      if (t->lc) S.push_back(diff_item(t->lc));
+  }
+
+  static const K& min_key(Node* t) {
+      while (!t->is_block && t->lc) t = t->lc;
+      return t->get_key();
+  }
+
+  // Reports the entries only in a, only in b, or in both with different
+  // values.  Walks both trees in order at once, skipping subtrees shared
+  // by the two (by pointer), so for versions of a map that share most of
+  // their structure the cost depends on the changes rather than the size.
+  // Sequential, and allocates no nodes.
+  template<class Add, class Remove, class Change>
+  static void t_diff(Node* a, Node* b, const Add& on_added,
+                     const Remove& on_removed, const Change& on_changed) {
+      std::vector<diff_item> A, B;
+      if (a) A.push_back(diff_item(a));
+      if (b) B.push_back(diff_item(b));
+      while (!A.empty() && !B.empty()) {
+          Node* x = A.back().t;
+          Node* y = B.back().t;
+          if (x && x == y) { A.pop_back(); B.pop_back(); }
+          else if (x && y) {
+              if (get_size_hint(x) >= get_size_hint(y)) diff_expand(A);
+              else diff_expand(B);
+          } else if (x) {
+              if (!comp(B.back().e.first, min_key(x))) diff_expand(A);
+              else { on_added(B.back().e); B.pop_back(); }
+          } else if (y) {
+              if (!comp(A.back().e.first, min_key(y))) diff_expand(B);
+              else { on_removed(A.back().e); A.pop_back(); }
+          } else {
+              const E& ea = A.back().e;
+              const E& eb = B.back().e;
+              if (comp(ea.first, eb.first)) { on_removed(ea); A.pop_back(); }
+              else if (comp(eb.first, ea.first)) { on_added(eb); B.pop_back(); }
+              else {
+                  if (!(ea.second == eb.second)) on_changed(ea, eb);
+                  A.pop_back(); B.pop_back();
+              }
+          }
+      }
+      while (!A.empty()) {
+          if (A.back().t) diff_expand(A);
+          else { on_removed(A.back().e); A.pop_back(); }
+      }
+      while (!B.empty()) {
+          if (B.back().t) diff_expand(B);
+          else { on_added(B.back().e); B.pop_back(); }
+      }
+  }
+
   template<class NodeType, class Func>
   static void t_forall(Node* b, const Func& f, NodeType*& join_node) {
       if (!b) {
@@ -272,53 +701,90 @@ struct tree_operations {
           return;
       }
 
-      typename NodeType::entry_type entry
-          = make_pair(b->get_key(), f(b->get_entry()));
+      using NE = typename NodeType::entry_type;
+      if (b->is_block) {
+          size_t n = b->block_size();
+          NE* out = pbbs::new_array_no_init<NE>(n);
+          block_iterator it = b->block_begin();
+          for (size_t i = 0; i < n; i++, ++it)
+              pbbs::assign_uninitialized(out[i], NE(it.key(), f(*it)));
+          join_node = NodeType::make_block(out, n, NULL);
+          pbbs::delete_array(out, n);
+          return;
+      }
+
+      NE entry = make_pair(b->get_key(), f(b->get_entry()));
 
       join_node = new NodeType(entry);
 
-      size_t mn = get_node_count(b);
-      auto P = fork<Node*>(mn >= node_limit,
-      [&] () {return t_forall(b->lc, f, join_node->lc);},
-      [&] () {return t_forall(b->rc, f, join_node->rc);});
+      size_t mn = get_size_hint(b);
+      par_do(mn >= node_limit,
+        [&] () {t_forall(b->lc, f, join_node->lc);},
+        [&] () {t_forall(b->rc, f, join_node->rc);});
 
       join_node->update();
   }
 
-  static Node* t_find(Node* b, const K& key) {
+  // pointer to the value stored with key, or NULL if not present
+  static const V* t_find(Node* b, const K& key) {
       while (b) {
+          if (b->is_block) {
+              const E* A = Node::block_type::array(b->block);
+              if (A != NULL) {
+                  size_t i = block_lower(b, key);
+                  if (i < b->block_size() && !comp(key, A[i].first))
+                      return &A[i].second;
+                  return NULL;
+              }
+              block_iterator it = b->block_begin();
+              for (size_t i = 0; i < b->block_size(); i++, ++it)
+                  if (!comp(it.key(), key))
+                      return comp(key, it.key()) ? NULL : &it.value();
+              return NULL;
+          }
           if ( comp(key, b->get_key()) ) b = b->lc;
           else if ( comp(b->get_key(), key) )  b = b->rc;
-          else return b;
+          else return &b->get_value();
       }
       return NULL;
   }
 
-  static Node* t_previous(Node* b, const K& key) {
+  static maybe<E> t_previous(Node* b, const K& key) {
       Node* r = NULL;
       while (b) {
+          if (b->is_block) {
+              size_t i = block_lower(b, key);
+              if (i > 0) return maybe<E>(block_entry(b, i-1));
+              break;
+          }
           if ( comp(b->get_key(), key) ) {
               r = b; b = b->rc;
           } else 
               b = b->lc;
       }
-      return r;
+      return r ? maybe<E>(r->get_entry()) : maybe<E>();
   }
 
-  static Node* t_next(Node* b, const K& key) {
+  static maybe<E> t_next(Node* b, const K& key) {
       Node* r = NULL;
       while (b) {
+          if (b->is_block) {
+              size_t i = block_upper(b, key);
+              if (i < b->block_size()) return maybe<E>(block_entry(b, i));
+              break;
+          }
           if (comp(key, b->get_key()) ) {
               r = b; b = b->lc;
           } else 
               b = b->rc;
       }
-      return r;
+      return r ? maybe<E>(r->get_entry()) : maybe<E>();
   }
 
   static size_t t_rank(Node* b, const K& key) {
       size_t ret = 0;
       while (b) {
+          if (b->is_block) return ret + block_lower(b, key);
           if ( comp(b->get_key(), key) ) {
               ret += 1 + get_node_count(b->lc);
               b = b->rc;
@@ -328,9 +794,13 @@ struct tree_operations {
       return ret;
   }
 
-  static Node* t_select(Node* b, size_t rank) {    
+  static maybe<E> t_select(Node* b, size_t rank) {    
       size_t lrank = rank;
       while (b) {
+          if (b->is_block) {
+              if (lrank < b->block_size()) return maybe<E>(block_entry(b, lrank));
+              break;
+          }
           size_t left_size = get_node_count(b->lc);
           if (lrank > left_size) {
               lrank -= left_size + 1;
@@ -339,19 +809,27 @@ struct tree_operations {
           else if (lrank < left_size) 
               b = b->lc;
           else 
-              return b;
+              return maybe<E>(b->get_entry());
     }
-    return NULL;
+    return maybe<E>();
   }
 
   static aug_type report_left(Node* b, const K& key) {
       aug_type ret = aug_class::get_empty();
   
       while (b) {
+          if (b->is_block) {
+              size_t i = block_upper(b, key);
+              if (i > 0) ret = aug_class::combine(ret, block_aug(b, 0, i));
+              break;
+          }
           if (!comp(key, b->get_key())) {
             ret = aug_class::combine(ret, aug_class::from_entry(b->get_key(), b->get_value()));
          
-            if (b->lc) ret = aug_class::combine(ret, (b->lc)->aug_val);
+            if (b->lc) ret = aug_class::combine(ret, get_aug(b->lc));
+            // on an equal key the right subtree is all greater, which
+            // saves reading back evicted blocks below it
+            if (!comp(b->get_key(), key)) break;
               b = b->rc;
           } else 
               b = b->lc;
@@ -363,10 +841,17 @@ struct tree_operations {
       aug_type ret = aug_class::get_empty();
 
       while (b) {
+          if (b->is_block) {
+              size_t i = block_lower(b, key);
+              if (i < b->block_size())
+                ret = aug_class::combine(ret, block_aug(b, i, b->block_size()));
+              break;
+          }
           if (!comp(b->get_key(), key)) {
             ret = aug_class::combine(ret, aug_class::from_entry(b->get_key(), b->get_value()));
             
-            if (b->rc) ret = aug_class::combine(ret, (b->rc)->aug_val);
+            if (b->rc) ret = aug_class::combine(ret, get_aug(b->rc));
+            if (!comp(key, b->get_key())) break;
             b = b->lc;
           } else 
             b = b->rc;
@@ -378,6 +863,12 @@ struct tree_operations {
       aug_type ret = aug_class::get_empty();
   
       while (b) {
+          if (b->is_block) {
+              size_t i = block_lower(b, key_left);
+              size_t j = block_upper(b, key_right);
+              if (i < j) ret = block_aug(b, i, j);
+              break;
+          }
           if (comp(key_right, b->get_key())) { b = b->lc; continue; } 
           if (comp(b->get_key(), key_left)) { b = b->rc; continue; }
 
@@ -391,31 +882,156 @@ struct tree_operations {
       return ret;
    }
 
+  // Maps each entry with key in [low, high] and reduces the results
+  // with the associative r, in parallel and without copying any nodes.
+  // check_low and check_high say whether the subtree may extend past
+  // the respective end; below the split point one of them is off, and
+  // subtrees inside the range are reduced with no key comparisons.
+  template<class T, class Map, class Reduce>
+  static T t_map_reduce_range(Node* b, const K& low, const K& high,
+                              const Map& m, const Reduce& r, const T& identity,
+                              bool check_low = true, bool check_high = true) {
+      while (b) {
+          if (b->is_block) {
+              size_t i = check_low ? block_lower(b, low) : 0;
+              size_t j = check_high ? block_upper(b, high) : b->block_size();
+              if (i >= j) return identity;
+              block_iterator it = b->block_begin();
+              for (size_t k = 0; k < i; k++) ++it;
+              T ret = m(*it);
+              for (size_t k = i+1; k < j; k++) { ++it; ret = r(ret, m(*it)); }
+              return ret;
+          }
+          if (check_low && comp(b->get_key(), low)) { b = b->rc; continue; }
+          if (check_high && comp(high, b->get_key())) { b = b->lc; continue; }
+          break;
+      }
+      if (!b) return identity;
+
+      size_t mn = get_size_hint(b);
+      auto P = fork<T>(mn >= node_limit,
+        [&] () {return t_map_reduce_range(b->lc, low, high, m, r, identity,
+                                          check_low, false);},
+        [&] () {return t_map_reduce_range(b->rc, low, high, m, r, identity,
+                                          false, check_high);});
+      return r(r(P.first, m(b->get_entry())), P.second);
+  }
+
+  // Applies f to each entry with key in [low, high], in parallel and in
+  // place.  f must be safe to call concurrently on different entries.
+  template<class Func>
+  static void t_foreach_range(Node* b, const K& low, const K& high,
+                              const Func& f,
+                              bool check_low = true, bool check_high = true) {
+      while (b) {
+          if (b->is_block) {
+              size_t i = check_low ? block_lower(b, low) : 0;
+              size_t j = check_high ? block_upper(b, high) : b->block_size();
+              block_iterator it = b->block_begin();
+              for (size_t k = 0; k < j; k++, ++it)
+                  if (k >= i) f(*it);
+              return;
+          }
+          if (check_low && comp(b->get_key(), low)) { b = b->rc; continue; }
+          if (check_high && comp(high, b->get_key())) { b = b->lc; continue; }
+          break;
+      }
+      if (!b) return;
+
+      size_t mn = get_size_hint(b);
+      par_do(mn >= node_limit,
+        [&] () {t_foreach_range(b->lc, low, high, f, check_low, false);},
+        [&] () {t_foreach_range(b->rc, low, high, f, false, check_high);});
+      f(b->get_entry());
+  }
+
   template<typename Func>
-  static Node* aug_select(Node* b, const Func& f) {
-    if (b == NULL) return NULL;
+  static maybe<E> aug_select(Node* b, const Func& f) {
+    if (b == NULL) return maybe<E>();
+    if (b->is_block) {
+      block_iterator it = b->block_begin();
+      for (size_t i = 0; i < b->block_size(); i++, ++it)
+        if (!f(aug_class::from_entry(it.key(), it.value())))
+          return maybe<E>(*it);
+      return maybe<E>();
+    }
     if (f(get_aug(b->lc))) {
       if (f(aug_class::from_entry(b->get_key(),b->get_value())))
 	return aug_select(b->rc, f);
-      return b;
+      return maybe<E>(b->get_entry());
     } return aug_select(b->lc, f);
   }
 
   // parallel conversion to array starting at out
+  // get is applied to each entry
   template<typename Out, typename Get>
   static void t_collect_at(Node* a, Out* out, const Get& get) {
+    collect_at(a, out, get, std::integral_constant<bool, Node::has_count>());
+  }
+
+  template<typename Out, typename Get>
+  static void collect_at(Node* a, Out* out, const Get& get, std::true_type) {
     if (!a) return;
+    if (a->is_block) {
+      block_iterator it = a->block_begin();
+      for (size_t i = 0; i < a->block_size(); i++, ++it)
+        out[i] = get(*it);
+      return;
+    }
     size_t lsize = get_node_count(a->lc);
-    auto P = fork<Node*>(lsize >= node_limit,
-      [&] () {return t_collect(a->lc, out, get);},
-      [&] () {return t_collect(a->rc, out+lsize+1, get);});
-    *(out+lsize) = get(a);
+    par_do(lsize >= node_limit,
+      [&] () {collect_at(a->lc, out, get, std::true_type());},
+      [&] () {collect_at(a->rc, out+lsize+1, get, std::true_type());});
+    *(out+lsize) = get(a->get_entry());
+  }
+
+  // without sizes the place of each entry is only known in order
+  template<typename Out, typename Get>
+  static void collect_at(Node* a, Out* out, const Get& get, std::false_type) {
+    t_collect_seq(a, out, get);
+  }
+
+  // number of entries, by a traversal for nodes without sizes
+  static size_t t_size(Node* t) {
+    return size_rec(t, std::integral_constant<bool, Node::has_count>());
+  }
+
+  static size_t size_rec(Node* t, std::true_type) { return get_node_count(t); }
+
+  static size_t size_rec(Node* t, std::false_type) {
+    if (!t) return 0;
+    auto P = fork<size_t>(get_size_hint(t) >= node_limit,
+      [&] () {return size_rec(t->lc, std::false_type());},
+      [&] () {return size_rec(t->rc, std::false_type());});
+    return P.first + P.second + 1;
+  }
+
+  // A reference to t for another map to hold: t itself with one more
+  // reference, or, for nodes without reference counts, which only one
+  // map can hold, a copy of the whole tree in the arena of t.
+  static Node* t_share(Node* t) {
+    return share(t, std::integral_constant<bool, Node::has_refs>());
+  }
+
+  static Node* share(Node* t, std::true_type) { increase(t); return t; }
+
+  static Node* share(Node* t, std::false_type) {
+    if (!t) return NULL;
+    arena* a = allocator::arena_of(t);
+    if (t->is_block)
+      return Node::make_block(block_array<Node>(t).A, t->block_size(), a);
+    Node* r = new (a) Node(t->get_entry(), NULL, NULL, false);
+    par_do(get_size_hint(t) >= node_limit,
+      [&] () {r->lc = share(t->lc, std::false_type());},
+      [&] () {r->rc = share(t->rc, std::false_type());});
+    r->update();
+    return r;
   }
 
   // parallel conversion to a new array 
   template<typename Out, typename Get>
   static Out* t_collect(Node* a, const Get& get) {
-    size_t n = get_node_count(a);
+    size_t n = t_size(a);
     Out* out = pbbs::new_array<Out>(n);
     t_collect_at(a, out, get);
     return out;
@@ -426,8 +1042,15 @@ struct tree_operations {
   template<typename OutIter, typename Get>
   static void t_collect_seq(Node* a, OutIter& out, const Get& get) {
     if (!a) return;
+    if (a->is_block) {
+      block_iterator it = a->block_begin();
+      for (size_t i = 0; i < a->block_size(); i++, ++it) {
+        *out = get(*it); ++out;
+      }
+      return;
+    }
     t_collect_seq(a->lc, out, get);
-    *out = get(a); ++out;
+    *out = get(a->get_entry()); ++out;
     t_collect_seq(a->rc, out, get);
   }
 
@@ -499,13 +1122,315 @@ struct tree_operations {
   static size_t combine_duplicates_seq(E* A, size_t n, Bin_Op& bin_op) {
     size_t j = 0;
     for (size_t i=1; i<n; i++) {
-      if (A[j].first < A[i].first)
+      if (comp(A[j].first, A[i].first))
 	A[++j] = A[i];
       else A[j].second = bin_op(A[j].second,A[i].second);
     }
     return j+1;
   }
 
+  // Collapses each run of operations on equal keys in a sorted batch
+  // into one operation with the same effect
+  static std::pair<batch_type*, size_t> combine_batch(batch_type* A, size_t n) {
+    bool* is_start = new bool[n];
+    is_start[0] = 1;
+    parallel_for(size_t i = 1; i < n; i++)
+      is_start[i] = comp(A[i-1].key, A[i].key);
+    array_imap<tree_size_t> I = 
+      pbbs::pack_index<tree_size_t>(make_array_imap(is_start,n));
+    delete[] is_start;
+
+    auto then = [] (const batch_type& a, const batch_type& b) {
+      return batch_type::then(a, b);};
+    batch_type* B = pbbs::new_array<batch_type>(I.size());
+    parallel_for(size_t i = 0; i < I.size(); i++) {
+      size_t start = I[i];
+      size_t end = (i==I.size()-1) ? n : I[i+1];
+      auto get_op = [&] (size_t i) {return A[i+start];};
+      B[i] = pbbs::reduce(make_in_imap<batch_type>(end-start,get_op), then);
+    }
+    return std::pair<batch_type*,size_t>(B,I.size());
+  }
+
+  static size_t combine_batch_seq(batch_type* A, size_t n) {
+    size_t j = 0;
+    for (size_t i=1; i<n; i++) {
+      if (comp(A[j].key, A[i].key))
+	A[++j] = A[i];
+      else A[j] = batch_type::then(A[j], A[i]);
+    }
+    return j+1;
+  }
+
+  // whether A is sorted with no two equal keys
+  static bool is_sorted_unique(E* A, size_t n) {
+    std::atomic<bool> ok(true);
+    parallel_for (size_t i=1; i < n; i++)
+      if (!comp(A[i-1].first, A[i].first))
+	ok.store(false, std::memory_order_relaxed);
+    return ok.load();
+  }
+
+  // Builds directly from A with no intermediate copies.  Unless trusted
+  // the order is checked first, and if A is not sorted with distinct keys
+  // the general construction is used instead.
+  static Node* from_sorted_unique(E* A, size_t n, bool trusted, arena* a) {
+    if (trusted || is_sorted_unique(A, n))
+      return t_from_sorted_array(A, n, a);
+    return multi_insert(NULL, A, n, false, false, a);
+  }
+
+  // As from_sorted_unique, with the nodes placed in one slab in van Emde
+  // Boas order (see t_layout).  Slower to build, faster to search.
+  static Node* from_sorted_layout(E* A, size_t n, bool trusted, arena* a) {
+    if (trusted || is_sorted_unique(A, n)) {
+      if (!tree_type::mid_split_balanced)
+	return t_layout(t_from_sorted_array(A, n, a));
+      return t_from_sorted_layout(A, n, a);
+    }
+    return t_layout(multi_insert(NULL, A, n, false, false, a));
+  }
+
+  // Cache-oblivious layout.  The nodes of a tree are placed in one slab
+  // in van Emde Boas order: the top half of the levels first, laid out
+  // the same way recursively, followed by each of the subtrees hanging
+  // below them in order.  A search then touches O(log_B n) cache lines,
+  // or pages, for any block size B.
+  //
+  // The placement is generic in where the nodes come from.  Src::item is
+  // a subtree still to be placed, Src::size gives its number of nodes (a
+  // leaf block counting as one) and its height, and Src::place constructs
+  // its root at a given address, adding the children still to be placed
+  // to a cut list.
+
+  // a subtree still to be placed, and the child field to point at it
+  template<class Item>
+  using layout_cut = std::pair<Item, Node**>;
+
+  // Places the top d levels of x from slab element pos on, setting *link
+  // to the new root.  The subtrees below those levels are appended to cut
+  // from left to right.
+  template<class Src>
+  static void layout_top(const Src& src, typename Src::item x, size_t d,
+			 void* slab, size_t& pos, Node** link,
+			 std::vector<layout_cut<typename Src::item>>& cut) {
+    if (src.placed(x, link)) return;
+    if (d == 0) { cut.push_back(layout_cut<typename Src::item>(x, link)); return; }
+    if (d == 1) {
+      *link = allocator::slab_element(slab, pos++);
+      src.place(x, *link, cut);
+      return;
+    }
+    // the subtrees below the top half go on the end of cut, and are
+    // replaced by what is below them
+    size_t start = cut.size();
+    layout_top(src, x, d/2, slab, pos, link, cut);
+    size_t end = cut.size();
+    for (size_t i = start; i < end; i++)
+      layout_top(src, cut[i].first, d - d/2, slab, pos, cut[i].second, cut);
+    cut.erase(cut.begin() + start, cut.begin() + end);
+  }
+
+  // x has n nodes of height h, to be placed from slab element pos.  The
+  // top half of the levels is placed sequentially, and the subtrees below
+  // it in parallel, each at an offset given by the sizes of those before.
+  template<class Src>
+  static Node* layout_rec(const Src& src, typename Src::item x, void* slab,
+			  size_t pos, size_t h, size_t n) {
+    Node* r;
+    std::vector<layout_cut<typename Src::item>> cut;
+    if (n < node_limit) {
+      layout_top(src, x, h, slab, pos, &r, cut);
+      return r;
+    }
+    layout_top(src, x, h/2, slab, pos, &r, cut);
+    size_t m = cut.size();
+    std::vector<std::pair<size_t,size_t>> S(m);
+    parallel_for (size_t i = 0; i < m; i++)
+      S[i] = src.size(cut[i].first);
+    std::vector<size_t> offset(m);
+    for (size_t i = 0; i < m; i++) {
+      offset[i] = pos;
+      pos += S[i].first;
+    }
+    parallel_for (size_t i = 0; i < m; i++)
+      *cut[i].second = layout_rec(src, cut[i].first, slab, offset[i],
+				  S[i].second, S[i].first);
+    return r;
+  }
+
+  // Moves the nodes of t owned only through t (reference count 1 on the
+  // whole path from t) into a new slab.  Subtrees shared with other trees
+  // stay where they are.  Consumes t and returns the relocated tree.
+  static Node* t_layout(Node* t) {
+    std::pair<size_t,size_t> S = owned_size(t);
+    if (S.first == 0) return t;
+    void* slab = allocator::alloc_slab(S.first, allocator::arena_of(t));
+    if (interleave_top) interleave_slab_top(slab, S);
+    return layout_rec(relocate_src(), t, slab, 0, S.second, S.first);
+  }
+
+  // Replaces the subtrees of t at the given depth, and leaf blocks above
+  // it, by leaf blocks whose entries are written to s.  Below that depth
+  // the nodes are kept down to subtrees of at most page_entries entries,
+  // each of which becomes one block, so a block read back is no larger
+  // than those built in memory and searches in it stay as short.  The
+  // blocks keep the size, rank and augmented value of the subtree they
+  // stand for, so nothing above them changes.  Shared nodes on the way
+  // down are copied as in any update, and subtrees that cannot be
+  // written stay in memory.  Consumes t.
+  static Node* t_evict(Node* t, size_t depth, size_t page_entries,
+		       page_store& s) {
+    if (!t || (t->is_block && Node::block_type::is_paged(t->block)))
+      return t;
+    if (t->is_block || (depth == 0 && get_node_count(t) <= page_entries)) {
+      size_t n = get_node_count(t);
+      if (n == 1) return t;
+      E* A = pbbs::new_array_no_init<E>(n);
+      t_collect_at(t, A, [] (const E& e) {return e;});
+      void* d = Node::block_type::create_paged(s, A, n);
+      Node* r = t;
+      if (d != NULL) {
+	r = new (allocator::arena_of(t)) Node();
+	r->block = d;
+	r->rc = NULL;
+	r->key = A[0].first;
+	r->is_block = true;
+	r->set_node_cnt(n);
+	r->set_rank_val(t->get_rank_val());
+	r->set_aug_val(t->get_aug_val());
+	decrease_recursive(t);
+      }
+      pbbs::delete_array(A, n);
+      return r;
+    }
+    Node* r = copy_if_needed(t);
+    size_t below = depth > 0 ? depth - 1 : 0;
+    par_do(get_size_hint(r) >= node_limit,
+      [&] () {r->lc = t_evict(r->lc, below, page_entries, s);},
+      [&] () {r->rc = t_evict(r->rc, below, page_entries, s);});
+    r->update();
+    return r;
+  }
+
+  // The top half of the levels, at most 2^(h/2)-1 nodes at the start of
+  // the slab, is placed by one thread, and the subtrees below it by the
+  // threads that go on to place them.  Interleaving the pages of the top
+  // spreads the nodes every search goes through over all NUMA nodes,
+  // while the pages below are placed on the node of the thread that
+  // first touches them.
+  static void interleave_slab_top(void* slab, std::pair<size_t,size_t> S) {
+    size_t top = std::min(S.first, (((size_t) 1) << (S.second/2)) - 1);
+    pbbs::numa_interleave(slab, top * allocator::block_size());
+  }
+
+  // nodes and height of the part of t that t_layout relocates
+  static std::pair<size_t,size_t> owned_size(Node* t) {
+    if (!t || t->is_shared()) return std::pair<size_t,size_t>(0, 0);
+    if (t->is_block) return std::pair<size_t,size_t>(1, 1);
+    auto P = fork<std::pair<size_t,size_t>>(get_size_hint(t) >= node_limit,
+      [&]() {return owned_size(t->lc);},
+      [&]() {return owned_size(t->rc);});
+    return std::pair<size_t,size_t>(P.first.first + P.second.first + 1,
+			   std::max(P.first.second, P.second.second) + 1);
+  }
+
+  struct relocate_src {
+    using item = Node*;
+
+    bool placed(Node* t, Node** link) const {
+      if (t && !t->is_shared()) return false;
+      *link = t;
+      return true;
+    }
+    std::pair<size_t,size_t> size(Node* t) const { return owned_size(t); }
+
+    // moves t, with its children and block, to r
+    void place(Node* t, Node* r, std::vector<layout_cut<item>>& cut) const {
+      ::new (r) Node(std::move(*t));
+      t->get_key().~K();
+      t->get_value().~V();
+      allocator::free(t);
+      if (r->is_block) return;
+      cut.push_back(layout_cut<item>(r->lc, &r->lc));
+      cut.push_back(layout_cut<item>(r->rc, &r->rc));
+    }
+  };
+
+  // As t_from_sorted_array, for balance schemes where that builds by
+  // splitting at the middle, but with the nodes placed straight into a
+  // slab.  The shape depends only on n, so the sizes of all subtrees are
+  // known up front.  Children are linked as they are placed and the
+  // augmented values filled in bottom up at the end.  The slab is
+  // allocated in arena a.
+  static Node* t_from_sorted_layout(E* A, size_t n, arena* a) {
+    if (n == 0) return NULL;
+    build_src src(A, n);
+    std::pair<size_t,size_t> S = src.size(std::make_pair(A, n));
+    void* slab = allocator::alloc_slab(S.first, a);
+    if (interleave_top) interleave_slab_top(slab, S);
+    Node* r = layout_rec(src, std::make_pair(A, n), slab, 0, S.second, S.first);
+    update_built(r, n);
+    return r;
+  }
+
+  struct build_src {
+    using item = std::pair<E*, size_t>;
+
+    // nodes and height for each subtree size that occurs, of which
+    // there are at most two per level
+    std::vector<std::pair<size_t, std::pair<size_t,size_t>>> sizes;
+
+    build_src(E* A, size_t n) { add_size(n); }
+
+    std::pair<size_t,size_t> add_size(size_t n) {
+      for (auto& s : sizes) if (s.first == n) return s.second;
+      std::pair<size_t,size_t> r(0, 0);
+      if (n == 1 || (n > 0 && n <= leaf_size)) r = std::make_pair(1, 1);
+      else if (n > 0) {
+	std::pair<size_t,size_t> L = add_size(n/2), R = add_size(n-n/2-1);
+	r = std::make_pair(L.first + R.first + 1,
+			   std::max(L.second, R.second) + 1);
+      }
+      sizes.push_back(std::make_pair(n, r));
+      return r;
+    }
+
+    bool placed(item x, Node** link) const {
+      if (x.second > 0) return false;
+      *link = NULL;
+      return true;
+    }
+    std::pair<size_t,size_t> size(item x) const {
+      for (auto& s : sizes) if (s.first == x.second) return s.second;
+      return std::pair<size_t,size_t>(0, 0);
+    }
+
+    void place(item x, Node* r, std::vector<layout_cut<item>>& cut) const {
+      E* A = x.first;
+      size_t n = x.second;
+      if (n == 1) ::new (r) Node(A[0]);
+      else if (n <= leaf_size) Node::init_block(::new (r) Node(), A, n);
+      else {
+	size_t mid = n/2;
+	::new (r) Node(A[mid], NULL, NULL, false);
+	cut.push_back(layout_cut<item>(item(A, mid), &r->lc));
+	cut.push_back(layout_cut<item>(item(A+mid+1, n-mid-1), &r->rc));
+      }
+    }
+  };
+
+  // fills in the nodes of a tree built from n entries by
+  // t_from_sorted_layout, children first
+  static void update_built(Node* t, size_t n) {
+    if (!t || t->is_block || n == 1) return;
+    size_t mid = n/2;
+    par_do(n >= node_limit,
+	   [&]() {update_built(t->lc, mid);},
+	   [&]() {update_built(t->rc, n-mid-1);});
+    t->update();
+  }
+
   // Keeps the first among duplicates
   static std::pair<E*, size_t> remove_duplicates(E* A, size_t n) {
 
@@ -526,7 +1451,7 @@ struct tree_operations {
   static size_t remove_duplicates_seq(E* A, size_t n) {
     size_t  j = 1;
     for (size_t i=1; i<n; i++)
-      if (A[j-1].first < A[i].first)
+      if (comp(A[j-1].first, A[i].first))
 	A[j++] = A[i];
     return  j;
   }
@@ -544,29 +1469,30 @@ struct tree_operations {
 
   template<class Vin, class Reduce>
   static Node* build_reduce(std::pair<K,Vin>* A, size_t n,
-			   const Reduce& reduce, bool is_sorted) {
+			   const Reduce& reduce, bool is_sorted, arena* a) {
     if (n == 0) return NULL;
     sort_keys(A, n, is_sorted);
     std::pair<E*,size_t> X = reduce_duplicates(A, n, reduce);
-    Node* r = t_from_sorted_array(X.first, X.second);
+    Node* r = t_from_sorted_array(X.first, X.second, a);
     pbbs::delete_array(X.first, X.second);
     return r;
   }
 
+  // new nodes go in arena a
   static Node* multi_insert(Node* In, E* A, size_t n, 
-			    bool is_sorted, bool sequential) {
+			    bool is_sorted, bool sequential, arena* a) {
     if (n == 0) return NULL;
 
     sort_keys(A, n, is_sorted);
     if (sequential || n < (1 << 14)) {
       size_t m = remove_duplicates_seq(A,n);
-      return t_multi_insert_rec(In, A, m, get_left<V>());
-      //} else if (is_sorted == 2) {
-      //return t_multi_insert_rec(In, A, n, get_left<V>());
+      return t_multi_insert_rec(In, A, m, get_left<V>(), a);
+    } else if (is_sorted && is_sorted_unique(A, n)) {
+      return t_multi_insert_rec(In, A, n, get_left<V>(), a);
     } else {      
       std::pair<E*,size_t> X = remove_duplicates(A, n);
       Node* r = t_multi_insert_rec(In, X.first, X.second, 
-				   get_left<V>());
+				   get_left<V>(), a);
       pbbs::delete_array(X.first, X.second);
       return r;
     } 
@@ -575,21 +1501,76 @@ struct tree_operations {
   template<class Combine>
   static Node* multi_insert(Node* In, E* A, size_t n, 
 			    const Combine& f, 
-			    bool is_sorted, bool sequential) {
+			    bool is_sorted, bool sequential, arena* a) {
     if (n == 0) return NULL;
     if ((sequential || n < (1 << 14)) && (n < (1 << 20))) {
       sort_keys(A, n, is_sorted, 1);
       size_t m = combine_duplicates_seq(A, n, f);
-      return t_multi_insert_rec(In, A, m, f);
+      return t_multi_insert_rec(In, A, m, f, a);
+    } else if (is_sorted && is_sorted_unique(A, n)) {
+      return t_multi_insert_rec(In, A, n, f, a);
+    } else {
+      sort_keys(A, n, is_sorted);
+      std::pair<E*,size_t> X = combine_duplicates(A, n, f);
+      Node* r = t_multi_insert_rec(In, X.first, X.second, f, a);
+      pbbs::delete_array(X.first, X.second);
+      return r;
+    }
+  }
+
+  static Node* multi_delete(Node* In, K* A, size_t n,
+			    bool is_sorted, bool sequential) {
+    if (n == 0) return In;
+    auto less = [&] (K a, K b) { return comp(a, b);};
+    if (!is_sorted) {
+      if (sequential || n < (1 << 14)) std::sort(A, A+n, less);
+      else pbbs::sample_sort(A, n, less);
+    }
+    return t_multi_delete(In, A, n);
+  }
+
+  template<class Combine>
+  static Node* multi_update(Node* In, E* A, size_t n, 
+			    const Combine& f, 
+			    bool is_sorted, bool sequential) {
+    if (n == 0) return In;
+    if ((sequential || n < (1 << 14)) && (n < (1 << 20))) {
+      sort_keys(A, n, is_sorted, 1);
+      size_t m = combine_duplicates_seq(A, n, f);
+      return t_multi_update(In, A, m, f);
+    } else if (is_sorted && is_sorted_unique(A, n)) {
+      return t_multi_update(In, A, n, f);
     } else {
       sort_keys(A, n, is_sorted);
       std::pair<E*,size_t> X = combine_duplicates(A, n, f);
-      Node* r = t_multi_insert_rec(In, X.first, X.second, f);
+      Node* r = t_multi_update(In, X.first, X.second, f);
       pbbs::delete_array(X.first, X.second);
       return r;
     }
   }
 
+  static Node* apply_batch(Node* In, batch_type* A, size_t n,
+			   bool sequential, arena* a) {
+    if (n == 0) return In;
+    if (sequential || n < (1 << 14)) {
+      size_t m = combine_batch_seq(A, n);
+      return t_apply_batch(In, A, m, a);
+    } else {
+      std::pair<batch_type*,size_t> X = combine_batch(A, n);
+      Node* r = t_apply_batch(In, X.first, X.second, a);
+      pbbs::delete_array(X.first, X.second);
+      return r;
+    }
+  }
+
+  // subtrees built with at most this many entries are stored as flat
+  // leaf blocks (0 disables blocking)
+  static size_t leaf_size;
+
+  // whether laid out trees have their top levels interleaved over the
+  // NUMA nodes (see interleave_slab_top)
+  static bool interleave_top;
+
 private:
 
     static key_compare comp;
@@ -598,3 +1579,9 @@ private:
 
 template<class Node> typename tree_operations<Node>::key_compare 
 tree_operations<Node>::comp = tree_operations<Node>::key_compare();
+
+template<class Node> size_t
+tree_operations<Node>::leaf_size = 0;
+
+template<class Node> bool
+tree_operations<Node>::interleave_top = false;
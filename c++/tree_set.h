@@ -147,27 +147,20 @@ tree_set<K>& tree_set<K>::operator = (const set_type& s) {
 
 template<class K>
 bool tree_set<K>::find(const key_type& key) {
-    node_type* curr = m.root;
-    
-    bool found = false;
-    while (curr) {
-        if (curr->key < key) 
-            curr = curr->rc;
-        else if (curr->key < key) 
-            curr = curr->lc;
-        else {
-            found = true;
-            break;
-        }
-    }
-    
-    return found;
+    return m.contains(key);
 }
 
 template<class K>
 template<class OutIterator>
 void tree_set<K>::collect_entries(const node_type* curr, OutIterator& out) {
     if (!curr) return;
+    if (curr->is_block) {
+        auto it = curr->block_begin();
+        for (size_t i = 0; i < curr->block_size(); i++, ++it) {
+            *out = it.key(); ++out;
+        }
+        return;
+    }
     
     collect_entries(curr->lc, out);
     *out = curr->get_key(); ++out;
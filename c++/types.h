@@ -1,5 +1,7 @@
 #pragma once
 
+#include <type_traits>
+
 template <class T>
 struct maybe {
 	T value;
@@ -26,6 +28,30 @@ struct maybe {
 	}
 };
 
+// Tagged updates applied together by augmented_map::apply_batch.
+// batch_insert adds the entry only if the key is absent, batch_upsert
+// adds it or replaces the value, and batch_remove deletes the key.
+enum batch_kind { batch_insert, batch_upsert, batch_remove };
+
+template <class K, class V>
+struct batch_op {
+  batch_kind kind;
+  K key;
+  V value;
+
+  batch_op() {}
+  batch_op(batch_kind kind, K key, V value = V())
+    : kind(kind), key(key), value(value) {}
+
+  // the single operation with the effect of a followed by b,
+  // for a and b on the same key (associative)
+  static batch_op then(const batch_op& a, const batch_op& b) {
+    if (b.kind != batch_insert) return b;
+    if (a.kind == batch_remove) return batch_op(batch_upsert, b.key, b.value);
+    return a;
+  }
+};
+
 typedef struct {
 
 } nill;
@@ -38,3 +64,11 @@ struct noop {
   static aug_t combine(aug_t a, aug_t b) { return 0;}
 };
 
+// whether nodes need to keep the augmented values of AugmOp, false for
+// augmentations whose values are always empty
+template <class AugmOp>
+struct keeps_aug : std::true_type {};
+
+template <class K, class V>
+struct keeps_aug<noop<K,V>> : std::false_type {};
+
@@ -0,0 +1,144 @@
+// Lock-free readers over a map updated by a single writer
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include "augmented_map.h"
+
+// Holds the current version of a map (any augmented_map type).  One
+// writer at a time publishes new versions, and any number of readers
+// can read the current version concurrently without locks and without
+// touching reference counts.
+//
+// Reclamation is epoch based.  A reader announces the global epoch in a
+// slot before loading the root and clears the slot when done.  When the
+// writer replaces a root it retires the old one, tagged with the epoch
+// at which it was replaced, and releases its reference (freeing the nodes
+// not shared with newer versions) only once no reader that could still
+// see it is active.
+//
+// The number of readers active at once is bounded by the number of
+// slots given to the constructor; further readers spin until one frees.
+template<class Map>
+class versioned_map {
+ public:
+  using map_type  = Map;
+  using node_type = typename Map::node_type;
+
+  static_assert(node_type::has_refs,
+		"versions need nodes with reference counts (see node_policy.h)");
+
+  versioned_map(size_t max_readers = 128)
+    : root(NULL), epoch(1), num_slots(max_readers) {
+    Map::init();
+    slots = pbbs::new_array_no_init<slot>(num_slots);
+    for (size_t i = 0; i < num_slots; i++)
+      new (static_cast<void*>(slots+i)) slot();
+  }
+
+  // starts from a version of m
+  versioned_map(const Map& m, size_t max_readers = 128)
+    : versioned_map(max_readers) {
+    Map c = m;
+    root.store(c.move_root());
+  }
+
+  // there must be no active readers
+  ~versioned_map() {
+    for (auto& r : retired) decrease_recursive(r.second);
+    decrease_recursive(root.load());
+    pbbs::delete_array(slots, num_slots);
+  }
+
+  // A read of the current version.  The map returned by get() stays
+  // valid until the reader is destroyed, even if newer versions are
+  // published meanwhile.  Readers should be short lived since they hold
+  // back reclamation; take a snapshot() to keep a version longer.
+  class reader {
+   public:
+    reader(versioned_map& vm) : vm(vm), s(vm.acquire()),
+				m(vm.root.load(std::memory_order_seq_cst)) {}
+    ~reader() {
+      m.move_root();  // the reader holds no reference
+      vm.slots[s].epoch.store(idle, std::memory_order_release);
+    }
+    const Map& get() const { return m; }
+   private:
+    versioned_map& vm;
+    size_t s;
+    Map m;
+  };
+
+  // the current version as a map holding its own reference
+  Map snapshot() {
+    reader r(*this);
+    return r.get();
+  }
+
+  // Writer side: only one thread may call these at a time.
+
+  // makes m the current version
+  void publish(Map m) {
+    node_type* old = root.exchange(m.move_root(), std::memory_order_seq_cst);
+    retired.push_back(std::make_pair(epoch.fetch_add(1), old));
+    reclaim();
+  }
+
+  // applies f to a copy of the current version and publishes the result
+  template<class F>
+  void update(const F& f) {
+    Map m = current();
+    f(m);
+    publish(std::move(m));
+  }
+
+  // releases retired versions no active reader can still see, returning
+  // the number still waiting
+  size_t reclaim() {
+    size_t min_epoch = idle;
+    for (size_t i = 0; i < num_slots; i++)
+      min_epoch = std::min(min_epoch,
+			   slots[i].epoch.load(std::memory_order_seq_cst));
+    size_t j = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+      if (retired[i].first < min_epoch) decrease_recursive(retired[i].second);
+      else retired[j++] = retired[i];
+    }
+    retired.resize(j);
+    return j;
+  }
+
+ private:
+  static constexpr size_t idle = ~((size_t) 0);
+
+  // one per cache line
+  struct alignas(64) slot {
+    slot() : epoch(idle) {}
+    std::atomic<size_t> epoch;
+  };
+
+  // the current version, for the writer
+  Map current() {
+    node_type* r = root.load();
+    increase(r);
+    return Map(r);
+  }
+
+  // announces the current epoch in a free slot, returning its index
+  size_t acquire() {
+    for (size_t i = 0; ; i = (i + 1 == num_slots) ? 0 : i + 1) {
+      size_t e = idle;
+      if (slots[i].epoch.load(std::memory_order_relaxed) == idle &&
+	  slots[i].epoch.compare_exchange_strong(e, epoch.load()))
+	return i;
+    }
+  }
+
+  std::atomic<node_type*> root;
+  std::atomic<size_t> epoch;
+  slot* slots;
+  size_t num_slots;
+  std::vector<std::pair<size_t, node_type*> > retired;
+};
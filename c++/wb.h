@@ -5,10 +5,10 @@
 #include <cstddef> 
 #include <utility>
 #include "abstract_node.h"
-const double alpha = 0.29;
-const double beta  = (1-2*alpha) / (1-alpha);
-
 
+// Balance is by weight (subtree size plus one), which node_cnt already
+// tracks, so ranks are unused and always 0.  Joins follow the same
+// right_join / left_join structure as avl_tree.
 template<class Node>
 class wb_tree {
  public:
@@ -19,48 +19,82 @@ class wb_tree {
 
   static tree_size_t singleton_rank() { return 0; }
 
-  static tree_size_t weight(const Node* t) {
-    if (t == NULL) return 1;
-    return t->node_cnt + 1;
+  static constexpr bool uses_rank = false;
+
+  // recursively splitting a sorted array at the middle gives a valid tree
+  static constexpr bool mid_split_balanced = true;
+
+  static Node* t_join(Node* t1, Node* t2, Node* k) {
+    if (is_too_heavy(t1, t2)) {
+      return right_join(t1, t2, k);
+    } else if (is_too_heavy(t2, t1)) {
+      return left_join(t1, t2, k);
+    } else {
+      k->lc = t1, k->rc = t2;
+      k->update();
+      return k;
+    }
   }
 
-  static inline bool is_too_heavy(const Node* t1, const Node* t2) {
-    return alpha * weight(t1) > (1 - alpha) * weight(t2);
+  // alpha must be at most 1 - 1/sqrt(2) for joins to rebalance with
+  // at most a double rotation
+  static constexpr double alpha() { return 0.29; }
+
+  static size_t weight(const Node* t) {
+    return get_node_count(t) + 1;
+  }
+
+  // whether subtrees of weights w1 and w2 can be siblings
+  static inline bool like(size_t w1, size_t w2) {
+    double w = alpha() * (w1 + w2);
+    return w <= w1 && w <= w2;
   }
 
-  static bool is_single_rotation(Node* t, bool child) {
-    int balance = weight(t->lc);
-    if (child) balance = weight(t) - balance;
-    return balance <= beta * weight(t);
+  static inline bool is_too_heavy(const Node* t1, const Node* t2) {
+    return alpha() * (weight(t1) + weight(t2)) > weight(t2);
   }
 
-  static Node* persist_rebalanceSingle(Node* t) {
-    Node* ret = t;
-    if (is_too_heavy(t->lc, t->rc)) {   
-      if (is_single_rotation(t->lc, 1)) ret = rotate_right(t);
-      else ret = double_rotate_right(t);
-    
-    } else if(is_too_heavy(t->rc, t->lc)) {
-      if (is_single_rotation(t->rc, 0)) ret = rotate_left(t);
-      else ret = double_rotate_left(t);
+  // t->rc was just replaced by a join result that is too heavy
+  static Node* rebalance_right(Node* t) {
+    Node* r = t->rc;
+    size_t wl = weight(t->lc);
+    if (like(wl, weight(r))) {
+      t->update();
+      return t;
     }
+    if (like(wl, weight(r->lc)) && like(wl + weight(r->lc), weight(r->rc)))
+      return rotate_left(t);
+    return double_rotate_left(t);
+  }
 
-    return ret;
+  // t->lc was just replaced by a join result that is too heavy
+  static Node* rebalance_left(Node* t) {
+    Node* l = t->lc;
+    size_t wr = weight(t->rc);
+    if (like(weight(l), wr)) {
+      t->update();
+      return t;
+    }
+    if (like(wr, weight(l->rc)) && like(wr + weight(l->rc), weight(l->lc)))
+      return rotate_right(t);
+    return double_rotate_right(t);
   }
 
-  static Node* t_join(Node* t1, Node* t2, Node* k) {
-    Node* ret = NULL;
-    
-    if (is_too_heavy(t1, t2)) {
-      ret = copy_if_needed(t1);
-      ret->rc = t_join(ret->rc, t2, k);
-    } else if (is_too_heavy(t2, t1)) {
-      ret = copy_if_needed(t2);
-      ret->lc = t_join(t1, ret->lc, k);
-    } else join_node(t1,t2,k);
-    
-    ret->update();
-    return persist_rebalanceSingle(ret);
+  static Node* right_join(Node* t1, Node* t2, Node* k) {
+    if (!is_too_heavy(t1, t2))
+      return join_node(t1, t2, k);
+
+    Node* ret = copy_if_needed(t1);
+    ret->rc = right_join(ret->rc, t2, k);
+    return rebalance_right(ret);
   }
 
+  static Node* left_join(Node* t1, Node* t2, Node* k) {
+    if (!is_too_heavy(t2, t1))
+      return join_node(t1, t2, k);
+
+    Node* ret = copy_if_needed(t2);
+    ret->lc = left_join(t1, ret->lc, k);
+    return rebalance_left(ret);
+  }
 };
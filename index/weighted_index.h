@@ -35,6 +35,8 @@ struct inv_index {
 
   inv_index(index_elt* start, index_elt* end) {
     size_t n = end - start;
+    // store posting lists in difference encoded blocks of doc ids
+    post_list::set_leaf_size(128);
     post_list::reserve((size_t) round(.45*n));
     index::reserve(n/300);
     auto reduce = [] (post_elt* s, post_elt* e) {
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <cstring>
 #include <vector>
+#include <limits>
 #include <parallel/algorithm>
 #include "tree_operations.h"
 #include "augmented_map.h"
@@ -145,48 +146,12 @@ struct RangeQuery {
 		return ans;
     }
 	
-	template<typename OutIter>
-	void rep_sec_l(sec_node* r, y_type y, OutIter& out) {
-		while (r) {
-			if (!(r->get_key().first > y)) {
-				if (r->lc) {
-					auto get = [] (sec_node* t) { return t->get_key(); };
-					tree_ops::t_collect_seq(r->lc, out, get);
-				}
-				*out = r->get_key(); ++out; 
-				r = r->rc; continue;
-			}
-			r = r->lc;
-		}		
-	}
-	
-	template<typename OutIter>
-	void rep_sec_r(sec_node* r, y_type y, OutIter& out) {
-		while (r) {
-			if (!(r->get_key().first < y)) {
-				if (r->rc) {
-					auto get = [] (sec_node* t) { return t->get_key(); };
-					tree_ops::t_collect_seq(r->rc, out, get);
-				}
-				*out = r->get_key(); ++out; 
-				r = r->lc; continue;
-			}
-			r = r->rc;
-		}		
-	}
-	
 	template<typename OutIter>
 	void rep_sec_range(sec_node* r, y_type y1, y_type y2, OutIter& out) {
-		if (!r) return;
-		while (r) {
-			if (y1 > r->get_key().first) {
-				r = r->rc; continue; }
-			if (y2 < r->get_key().first) {
-				r = r->lc; continue; }
-			*out = r->get_key(); ++out;
-			rep_sec_r(r->lc, y1, out);
-			rep_sec_l(r->rc, y2, out);
-			break;
+		typename sec_aug::cursor c(r);
+		c.seek(make_pair(y1, numeric_limits<x_type>::lowest()));
+		for (; c.valid() && !(y2 < c.get_key().first); c.next()) {
+			*out = c.get_key(); ++out;
 		}
 	}
 
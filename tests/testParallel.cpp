@@ -24,6 +24,8 @@ struct aug {
 };
 
 using tmap = augmented_map<int, int, aug>;
+using wb_map = augmented_map<int, int, aug, less<int>, wb_tree>;
+using treap_map = augmented_map<int, int, aug, less<int>, treap_tree>;
 using par = pair<int, int>;
 //using tmap = tree_map<int, int>;
 //using par = pair<int, int>;
@@ -562,6 +564,65 @@ double stl_vector_union(size_t n, size_t m) {
 }
 
 
+// the same workloads run against a given balancing scheme
+template<class Map>
+double scheme_union(size_t n, size_t m) {
+    par* v1 = uniform_input(n, 20); 
+    Map m1(v1, v1 + n);
+    
+    par* v2 = uniform_input(m, (n/m) * 20); 
+    Map m2(v2, v2 + m);
+
+    timer t;
+    t.start();
+    Map m3 = map_union(m1, m2);
+    double tm = t.stop();
+
+    delete[] v1;
+    delete[] v2;
+
+    return tm;
+}
+
+template<class Map>
+double scheme_insertion(size_t n, size_t m) {
+    par *v = uniform_input(n, 20);
+    par *u = uniform_input(m, (n/m)*20);
+	
+    Map m1(v, v + n);
+    shuffle(u, m);
+
+    timer t;
+    t.start();
+    for (size_t i = 0; i < m; ++i) 
+        m1.insert(u[i]);
+
+    double tm = t.stop();
+    delete[] v;
+    delete[] u;
+    return tm;
+}
+
+template<class Map>
+double scheme_deletion(size_t n, size_t m) {
+    par *v = uniform_input(n, 20);
+    par *u = uniform_input(m, (n/m)*20);
+
+    Map m1(v, v + n);
+    shuffle(u, m);
+
+    timer t;
+    t.start();
+    for (size_t i = 0; i < m; ++i) 
+        m1.remove(u[i].first);
+
+    double tm = t.stop();
+    delete[] v;
+    delete[] u;
+    return tm;
+}
+
+
 string test_name[] = { 
     "persistent-union",      // 0
     "persistent-intersect",  // 1
@@ -580,7 +641,16 @@ string test_name[] = {
     "multi_insert",           // 14
 	"test_insesrtion_build",  //15
 	"stl_insertion_build",   //16
-	"test_deletion_destroy" //17
+	"test_deletion_destroy", //17
+    "avl-union",             // 18
+    "wb-union",              // 19
+    "avl-insert",            // 20
+    "wb-insert",             // 21
+    "avl-delete",            // 22
+    "wb-delete",             // 23
+    "treap-union",           // 24
+    "treap-insert",          // 25
+    "treap-delete"           // 26
 };
 
 
@@ -623,12 +693,39 @@ double execute(size_t id, size_t n, size_t m) {
 			return stl_insertion_build(n);
 		case 17:
 			return test_deletion_destroy(n);
+        case 18:
+            return scheme_union<tmap>(n, m);
+        case 19:
+            return scheme_union<wb_map>(n, m);
+        case 20:
+            return scheme_insertion<tmap>(n, m);
+        case 21:
+            return scheme_insertion<wb_map>(n, m);
+        case 22:
+            return scheme_deletion<tmap>(n, m);
+        case 23:
+            return scheme_deletion<wb_map>(n, m);
+        case 24:
+            return scheme_union<treap_map>(n, m);
+        case 25:
+            return scheme_insertion<treap_map>(n, m);
+        case 26:
+            return scheme_deletion<treap_map>(n, m);
         default: 
             assert(false);
 	    return 0.0;
     }
 }
 
+// runs test id with nodes reserved for Map, the map type it uses
+template<class Map>
+double run_with(size_t id, size_t n, size_t m, bool randomize) {
+    Map::reserve(4 * n, randomize);
+    double tm = execute(id, n, m);
+    Map::finish();
+    return tm;
+}
+
 /*
  * argv[1] - test
  * argv[2] - n
@@ -652,8 +749,17 @@ int main (int argc, char *argv[]) {
 
 
     for (size_t i = 0; i < repeat; ++i) {
-        tmap::reserve(4 * n, randomize);    
-        double tm = execute(test_id, n, m);
+        double tm;
+        switch (test_id) {
+            case 19: case 21: case 23:
+                tm = run_with<wb_map>(test_id, n, m, randomize);
+                break;
+            case 24: case 25: case 26:
+                tm = run_with<treap_map>(test_id, n, m, randomize);
+                break;
+            default:
+                tm = run_with<tmap>(test_id, n, m, randomize);
+        }
         cout << "RESULT"  << fixed << setprecision(6)
              << "\ttest=" << test_name[test_id]
              << "\ttime=" << tm
@@ -661,8 +767,6 @@ int main (int argc, char *argv[]) {
              << "\tm=" << m
              << "\titeration=" << i 
              << "\tp=" << threads << endl;
-
-        tmap::finish();
      }
 
     return 0;
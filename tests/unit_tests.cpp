@@ -1,4 +1,10 @@
 #include "augmented_map.h"
+#include "versioned_map.h"
+#include "batched_writer.h"
+#include "durable_map.h"
+#include "map_builder.h"
+#include "map_image.h"
+#include "page_store.h"
 #include <iostream>
 #include <algorithm>
 #include "../index/index.h"
@@ -13,6 +19,8 @@ struct aug {
 };
 
 using map  = augmented_map<int, int, aug>;
+using treap = augmented_map<int, int, aug, less<int>, treap_tree>;
+using pmap = paged_map<int, int, aug>;
 using elt = pair<int,int>;
 
 void check(bool test, string message) {
@@ -200,6 +208,1007 @@ void test_map() {
   delete mb_p;
 }    
 
+// a reference map over keys [0, r.size()), -1 marks a missing key
+using ref_map = vector<int>;
+
+vector<elt> ref_content(const ref_map& r, int lo = 0, int hi = -1) {
+  vector<elt> e;
+  if (hi < 0) hi = r.size() - 1;
+  for (int k = lo; k <= hi; k++) if (r[k] >= 0) e.push_back(elt(k, r[k]));
+  return e;
+}
+
+bool same(map& m, const ref_map& r) {
+  vector<elt> e;
+  m.content(back_inserter(e));
+  return e == ref_content(r);
+}
+
+void test_map_blocks() {
+  map::set_leaf_size(8);
+  size_t n = 1000;
+  int range = 4*n;
+  elt* a = new elt[n];
+  elt* b = new elt[n];
+  ref_map ra(range, -1), rb(range, -1);
+  for (size_t i = 0; i < n; i++) {
+    do a[i] = elt(rand() % range, rand() % 100); while (ra[a[i].first] >= 0);
+    do b[i] = elt(rand() % range, rand() % 100); while (rb[b[i].first] >= 0);
+    ra[a[i].first] = a[i].second;
+    rb[b[i].first] = b[i].second;
+  }
+  {
+    elt* c = new elt[n];
+    std::copy(a, a+n, c);
+    map ma(c, c+n);
+    std::copy(b, b+n, c);
+    map mb(c, c+n);
+    delete[] c;
+    check(same(ma, ra), "blocks: build");
+    check(map::num_used_nodes() < (ma.size() + mb.size())/3,
+	  "blocks: node count");
+
+    vector<elt> ea = ref_content(ra);
+    float total = 0;
+    for (elt x : ea) total += x.second/2.0;
+    check(ma.aug_val() == total, "blocks: aug value");
+
+    for (int k = 0; k < range; k += 7) {
+      size_t rank = 0;
+      float left = 0;
+      while (rank < ea.size() && ea[rank].first < k) 
+	left += ea[rank++].second/2.0;
+      check(ma.contains(k) == (ra[k] >= 0), "blocks: find");
+      check(ma.rank(k) == rank, "blocks: rank");
+      if (ra[k] >= 0) left += ra[k]/2.0;
+      check(ma.aug_left(k) == left, "blocks: aug left");
+      size_t nx = rank + (ra[k] >= 0);
+      check(ma.next(k) ? (nx < ea.size() && *ma.next(k) == ea[nx])
+	               : nx == ea.size(), "blocks: next");
+    }
+    check(ma.select(17) == ea[17], "blocks: select");
+
+    ref_map ru = rb, ri(range, -1), rd(range, -1);
+    for (int k = 0; k < range; k++) {
+      if (ra[k] >= 0) ru[k] = ra[k];
+      if (ra[k] >= 0 && rb[k] >= 0) ri[k] = ra[k];
+      if (ra[k] >= 0 && rb[k] < 0) rd[k] = ra[k];
+    }
+    map mu = map_union(ma, mb);
+    check(same(mu, ru), "blocks: union");
+    map mi = map_intersect(ma, mb);
+    check(same(mi, ri), "blocks: intersect");
+    map md = map_difference(ma, mb);
+    check(same(md, rd), "blocks: difference");
+
+    auto split = ma.split(a[0].first);
+    check(split.first.size() + split.second.size() + 1 == ea.size(),
+	  "blocks: split");
+
+    map mf = ma;
+    mf.filter([] (elt e) { return (e.first & 1) == 0; });
+    ref_map rf = ra;
+    for (int k = 1; k < range; k += 2) rf[k] = -1;
+    check(same(mf, rf), "blocks: filter");
+
+    map mr = ma.range(100, 2000);
+    vector<elt> er;
+    mr.content(back_inserter(er));
+    check(er == ref_content(ra, 100, 2000), "blocks: range");
+
+    for (size_t i = 0; i < n; i += 3) {
+      ma.insert(b[i]); ra[b[i].first] = b[i].second;
+      ma.remove(a[i].first); ra[a[i].first] = -1;
+    }
+    check(same(ma, ra), "blocks: insert and remove");
+
+    std::sort(b, b+n);
+    ma.multi_insert(b, b+n, true);
+    for (size_t i = 0; i < n; i++) ra[b[i].first] = b[i].second;
+    check(same(ma, ra), "blocks: multi insert");
+    check(ma == map_union(ma, mb), "blocks: equality");
+
+    vector<int> del;
+    for (int k = 0; k < range; k += 3) del.push_back(k);
+    for (int k = range-1; k >= 0; k -= 5) del.push_back(k);
+    map mc = ma;
+    mc.multi_delete(del.data(), del.data() + del.size());
+    ref_map rc = ra;
+    for (int k : del) rc[k] = -1;
+    check(same(mc, rc) && same(ma, ra), "blocks: multi delete");
+
+    for (size_t i = 0; i < n; i++) b[i].second = 1000;
+    mc.multi_update(b, b+n, [] (int x, int y) { return x + y; });
+    for (size_t i = 0; i < n; i++)
+      if (rc[b[i].first] >= 0) rc[b[i].first] += 1000;
+    check(same(mc, rc), "blocks: multi update");
+
+    vector<map::batch_type> ops;
+    for (size_t i = 0; i < 2*n; i++)
+      ops.push_back(map::batch_type(batch_kind(rand() % 3), 
+				    rand() % range, rand() % 100));
+    std::stable_sort(ops.begin(), ops.end(), 
+		     [] (const map::batch_type& x, const map::batch_type& y) {
+		       return x.key < y.key;});
+    ref_map rn(range, -1);
+    for (auto& o : ops) {
+      if (o.kind == batch_remove) rc[o.key] = rn[o.key] = -1;
+      else {
+	if (o.kind == batch_upsert || rc[o.key] < 0) rc[o.key] = o.value;
+	if (o.kind == batch_upsert || rn[o.key] < 0) rn[o.key] = o.value;
+      }
+    }
+    vector<map::batch_type> ops2 = ops;
+    map mn;
+    mc.apply_batch(ops.data(), ops.data() + ops.size());
+    mn.apply_batch(ops2.data(), ops2.data() + ops2.size());
+    check(same(mc, rc), "blocks: apply batch");
+    check(same(mn, rn), "blocks: apply batch to empty map");
+  }
+  check(map::num_used_nodes() == 0, "blocks: used nodes at end");
+
+  for (size_t leaf = 0; leaf <= 8; leaf += 8) { // cursors
+    map::set_leaf_size(leaf);
+    elt* c = new elt[n];
+    std::copy(a, a+n, c);
+    map ma(c, c+n);
+    vector<elt> ea(c, c+n);
+    std::sort(ea.begin(), ea.end());
+    delete[] c;
+
+    map::cursor cur = ma.get_cursor();
+    check(!cur.valid(), "cursor: initially invalid");
+    vector<elt> fwd, bwd;
+    for (cur.seek_first(); cur.valid(); cur.next()) fwd.push_back(cur.get_entry());
+    for (cur.seek_last(); cur.valid(); cur.prev()) bwd.push_back(cur.get_entry());
+    std::reverse(bwd.begin(), bwd.end());
+    check(fwd == ea && bwd == ea, "cursor: full scans");
+
+    for (int k = -1; k <= range; k += 13) {
+      size_t i = 0;
+      while (i < ea.size() && ea[i].first < k) i++;
+      cur.seek(k);
+      check(cur.valid() == (i < ea.size()), "cursor: seek");
+      if (i + 2 < ea.size()) {
+	check(cur.get_entry() == ea[i], "cursor: seek entry");
+	cur.next(); cur.next();
+	check(cur.get_key() == ea[i+2].first, "cursor: next after seek");
+	cur.prev();
+	check(cur.get_value() == ea[i+1].second, "cursor: prev after seek");
+      }
+    }
+    for (size_t r = 0; r < ea.size(); r += 17) {
+      cur.seek_rank(r);
+      check(cur.valid() && cur.get_entry() == ea[r], "cursor: seek rank");
+    }
+    cur.seek_rank(ea.size());
+    check(!cur.valid(), "cursor: seek rank past end");
+
+    // range scans in place
+    size_t used = map::num_used_nodes();
+    for (int lo = -5; lo <= range; lo += 97) {
+      int hi = lo + (lo % 5) * 300;
+      long sum = 0; size_t cnt = 0;
+      for (elt x : ea)
+	if (x.first >= lo && x.first <= hi) { sum += x.second; cnt++; }
+      auto get = [] (const elt& e) -> long { return e.second; };
+      auto add = [] (long x, long y) { return x + y; };
+      check(ma.map_reduce_range(lo, hi, get, add) == sum,
+	    "range scan: map reduce");
+      vector<char> seen(range, 0);
+      ma.foreach_range(lo, hi, [&] (const elt& e) { seen[e.first] = 1; });
+      size_t s = 0;
+      for (int k = 0; k < range; k++) s += seen[k];
+      check(s == cnt, "range scan: foreach");
+    }
+    check(map::num_used_nodes() == used, "range scan: no allocation");
+  }
+
+  { // difference encoding across the whole key range
+    const int big = 2147483647;
+    elt c[8] = {elt(-big-1, 1), elt(-big, 2), elt(-70000, 3), elt(-1, 4),
+		elt(0, 5), elt(300, 6), elt(big-1, 7), elt(big, 8)};
+    map mc(c, c+8, true);
+    vector<elt> e;
+    mc.content(back_inserter(e));
+    check(e == vector<elt>(c, c+8), "blocks: encoded content");
+    check(*mc.find(300) == 6 && !mc.find(299), "blocks: encoded find");
+    check(mc.rank(0) == 4, "blocks: encoded rank");
+    mc.remove(0);
+    check(*mc.find(big) == 8 && mc.size() == 7, "blocks: encoded remove");
+  }
+  { // plain blocks, since only std::less keys are encoded
+    using rmap = augmented_map<int, int, aug, greater<int> >;
+    rmap::set_leaf_size(8);
+    vector<elt> ea = ref_content(ra);
+    vector<elt> c(ea.rbegin(), ea.rend());
+    rmap mr(c.data(), c.data() + c.size());
+    for (int k = 0; k < range; k += 3) {
+      check(mr.contains(k) == (ra[k] >= 0) &&
+	    (ra[k] < 0 || *mr.find(k) == ra[k]), "plain blocks: find");
+      auto nx = mr.next(k);
+      auto it = lower_bound(ea.begin(), ea.end(), elt(k, -1));
+      check(bool(nx) == (it != ea.begin()) &&
+	    (!nx || (*nx).first == (it - 1)->first), "plain blocks: next");
+    }
+    for (size_t i = 0; i < ea.size(); i += 5)
+      check(mr.select(i) == ea[ea.size() - 1 - i], "plain blocks: select");
+    rmap::set_leaf_size(0);
+  }
+  map::set_leaf_size(0);
+  delete[] a;
+  delete[] b;
+}
+
+// checks a map using balancing scheme M against a reference map,
+// including that its height is logarithmic
+template<class M>
+bool same_balanced(M& m, const ref_map& r, size_t height_factor) {
+  vector<elt> e;
+  m.content(back_inserter(e));
+  size_t h = get_height(m.get_root());
+  return e == ref_content(r) && 
+    h <= height_factor*pbbs::log2_up(m.size()+1) + 1;
+}
+
+template<class M>
+void test_balance_scheme(string name, size_t height_factor = 2) {
+  for (size_t leaf = 0; leaf <= 8; leaf += 8) {
+    M::set_leaf_size(leaf);
+    int range = 20000;
+    ref_map ra(range, -1), rb(range, -1);
+    vector<elt> a, b;
+    for (int i = 0; i < 3000; i++) {
+      int ka = rand() % range, kb = rand() % (range/4);
+      if (ra[ka] < 0) { a.push_back(elt(ka, i)); ra[ka] = i; }
+      if (rb[kb] < 0) { b.push_back(elt(kb, i)); rb[kb] = i; }
+    }
+    M ma(a.data(), a.data() + a.size());
+    M mb(b.data(), b.data() + b.size());
+    check(same_balanced(ma, ra, height_factor), name + ": build");
+    vector<elt> sa = ref_content(ra);
+    M ms = M::from_sorted_unique(sa.data(), sa.data() + sa.size(), true);
+    check(same_balanced(ms, ra, height_factor), name + ": sorted build");
+
+    for (int i = 0; i < 3000; i++) {
+      int k = rand() % range;
+      if (i & 1) { ma.insert(elt(k, i)); ra[k] = i; }
+      else { ma.remove(k); ra[k] = -1; }
+    }
+    check(same_balanced(ma, ra, height_factor), name + ": insert and remove");
+
+    M mu = map_union(ma, mb), md = map_difference(ma, mb);
+    M mi = map_intersect(ma, mb);
+    ref_map ru = rb, rd = ra, ri(range, -1);
+    for (int k = 0; k < range; k++) {
+      if (ra[k] >= 0) ru[k] = ra[k];
+      if (rb[k] >= 0) rd[k] = -1;
+      if (ra[k] >= 0 && rb[k] >= 0) ri[k] = ra[k];
+    }
+    check(same_balanced(mu, ru, height_factor), name + ": union");
+    check(same_balanced(md, rd, height_factor), name + ": difference");
+    check(same_balanced(mi, ri, height_factor), name + ": intersect");
+
+    auto sp = mu.split(range/3);
+    M mj = map_union(sp.second, sp.first);
+    ru[range/3] = -1;
+    check(same_balanced(mj, ru, height_factor), name + ": split and join");
+
+    for (elt& x : b) x.first += range/2;
+    ma.multi_insert(b.data(), b.data() + b.size());
+    for (elt x : b) ra[x.first] = x.second;
+    check(same_balanced(ma, ra, height_factor), name + ": multi insert");
+  }
+  M::set_leaf_size(0);
+  check(M::num_used_nodes() == 0, name + ": used nodes at end");
+}
+
+// set operations on two versions sharing most of their structure
+// only touch the parts that differ
+void test_shared_versions() {
+  size_t n = 20000;
+  vector<elt> a;
+  for (size_t i = 0; i < n; i++) a.push_back(elt(2*i, i));
+  map m1(a.data(), a.data() + n, true);
+  map m2 = m1;
+  for (int i = 0; i < 5; i++) m2.insert(elt(2*(i*3001 % n) + 1, 0));
+  m2.remove(10);
+  size_t used = map::num_used_nodes();
+  map mu = map_union(m1, m2);
+  map mi = map_intersect(m1, m2);
+  map md = map_difference(m1, m2);
+  check(map::num_used_nodes() - used < 500, "shared versions: nodes used");
+  check(mu.size() == n + 5 && mi.size() == n - 1 && md.size() == 1,
+	"shared versions: sizes");
+  check(md.contains(10) && !mi.contains(10) && mu.contains(10),
+	"shared versions: contents");
+  check(map_difference(m2, m2).size() == 0 && map_union(m2, m2) == m2,
+	"shared versions: with itself");
+
+  for (size_t leaf = 0; leaf <= 8; leaf += 8) { // diffs
+    map::set_leaf_size(leaf);
+    map v1(a.data(), a.data() + n, true);
+    map v2 = v1;
+    ref_map r1(2*n, -1), r2;
+    for (elt x : a) r1[x.first] = x.second;
+    r2 = r1;
+    for (int i = 0; i < 50; i++) {
+      int k = rand() % (2*n), v = rand() % 3;
+      if (i % 5 == 0) { v2.remove(k); r2[k] = -1; }
+      else { v2.insert(elt(k, v)); r2[k] = v; }
+    }
+    vector<elt> added, removed, changed;
+    map_diff(v1, v2, 
+	     [&] (const elt& e) { added.push_back(e); },
+	     [&] (const elt& e) { removed.push_back(e); },
+	     [&] (const elt& e1, const elt& e2) {
+	       check(e1.first == e2.first, "diff: changed keys");
+	       changed.push_back(e2); });
+    vector<elt> ra, rr, rc;
+    for (size_t k = 0; k < 2*n; k++) {
+      if (r1[k] < 0 && r2[k] >= 0) ra.push_back(elt(k, r2[k]));
+      if (r1[k] >= 0 && r2[k] < 0) rr.push_back(elt(k, r1[k]));
+      if (r1[k] >= 0 && r2[k] >= 0 && r1[k] != r2[k]) 
+	rc.push_back(elt(k, r2[k]));
+    }
+    check(added == ra && removed == rr && changed == rc, "diff: entries");
+  }
+  map::set_leaf_size(0);
+}
+
+void test_versioned_map() {
+  elt a[3] = {elt(1,1), elt(2,2), elt(3,3)};
+  {
+    versioned_map<map> vm(map(a, a+3), 4);
+    size_t used = map::num_used_nodes();
+    {
+      versioned_map<map>::reader r(vm);
+      const map& m = r.get();
+      vm.update([] (map& m) { m.insert(elt(4,4)); m.remove(1); });
+      vm.update([] (map& m) { m.insert(elt(5,5)); });
+      check(vm.reclaim() == 2, "versioned map: retired while read");
+      check(m.size() == 3 && m.contains(1) && !m.contains(4),
+	    "versioned map: reader keeps its version");
+      versioned_map<map>::reader r2(vm);
+      check(r2.get().size() == 4 && r2.get().contains(5), 
+	    "versioned map: new reader sees latest");
+    }
+    check(vm.reclaim() == 0, "versioned map: reclaimed after read");
+    check(map::num_used_nodes() <= used + 2, "versioned map: nodes freed");
+    map s = vm.snapshot();
+    vm.update([] (map& m) { m.remove(5); });
+    check(vm.reclaim() == 0 && s.contains(5) && !vm.snapshot().contains(5),
+	  "versioned map: snapshot outlives version");
+  }
+  check(map::num_used_nodes() == 0, "versioned map: used nodes at end");
+
+  {
+    versioned_map<map> vm;
+    batched_writer<map> w(vm);
+    for (int i = 0; i < 100; i++) w.insert(elt(i, i));
+    w.insert(elt(5, 50));
+    w.insert_if_absent(elt(6, 60));
+    w.remove(7);
+    w.flush();
+    map m = vm.snapshot();
+    check(m.size() == 99 && *m.find(5) == 50 && *m.find(6) == 6 &&
+	  !m.contains(7), "batched writer");
+  }
+  check(map::num_used_nodes() == 0, "batched writer: used nodes at end");
+
+  { // threads inserting and removing the same keys at once
+    const int threads = 4, keys = 2000, extra = 500;
+    versioned_map<map> vm;
+    batched_writer<map> w(vm);
+    std::atomic<int> inserted(0);
+    vector<std::thread> ts;
+    for (int t = 0; t < threads; t++)
+      ts.push_back(std::thread([&, t] () {
+	  for (int i = 0; i < keys; i++) {
+	    int k = (i + t * 97) % keys;
+	    w.insert(elt(k, k));
+	  }
+	  inserted++;
+	  while (inserted.load() < threads) std::this_thread::yield();
+	  // every thread removes the multiples of 3, and neighbouring
+	  // threads add half of the same new keys
+	  for (int i = 0; i < keys; i += 3) w.remove(i);
+	  for (int i = keys + t * extra; i < keys + (t + 2) * extra; i++)
+	    w.insert_if_absent(elt(i, i));
+	}));
+    for (auto& x : ts) x.join();
+    map m = vm.snapshot();
+    vector<elt> e;
+    m.content(back_inserter(e));
+    vector<elt> expected;
+    for (int i = 0; i < keys; i++)
+      if (i % 3 != 0) expected.push_back(elt(i, i));
+    for (int i = keys; i < keys + (threads + 1) * extra; i++)
+      expected.push_back(elt(i, i));
+    check(e == expected, "batched writer: threads");
+    check(vm.reclaim() == 0, "batched writer: threads reclaimed");
+  }
+  check(map::num_used_nodes() == 0, "batched writer: threads used nodes");
+}
+
+void test_map_builder() {
+  size_t n = 10000, chunk = 300;
+  int range = 5000;
+  ref_map r(range, -1);
+  vector<elt> in;
+  for (size_t i = 0; i < n; i++) in.push_back(elt(rand() % range, i));
+  {
+    map_builder<map> b;
+    vector<elt> buf;
+    for (size_t i = 0; i < n; i += chunk) {
+      buf.assign(in.begin() + i, in.begin() + min(n, i + chunk));
+      // one value per key within a chunk, so later chunks decide
+      for (elt& x : buf) x.second = i;
+      for (elt x : buf) r[x.first] = x.second;
+      b.add_chunk(buf.data(), buf.data() + buf.size());
+    }
+    size_t bound = b.size();
+    map m = b.finish();
+    check(same(m, r) && bound >= m.size(), "builder: content");
+    check(b.size() == 0 && b.finish().size() == 0, "builder: empty after finish");
+  }
+  check(map::num_used_nodes() == 0, "builder: used nodes at end");
+}
+
+// whether all nodes of t lie in [lo, hi), counting them in cnt
+template<class T>
+bool in_layout(T* t, size_t& cnt, T* lo, T* hi) {
+  if (!t) return true;
+  if (t < lo || t >= hi) return false;
+  cnt++;
+  return t->is_block || (in_layout(t->lc, cnt, lo, hi) &&
+                         in_layout(t->rc, cnt, lo, hi));
+}
+
+void test_from_sorted_unique() {
+  size_t n = 50000;
+  ref_map r(2*n, -1);
+  vector<elt> v;
+  for (size_t i = 0; i < n; i++) v.push_back(elt(2*i, i));
+  for (elt x : v) r[x.first] = x.second;
+  {
+    map m1 = map::from_sorted_unique(v.data(), v.data() + n, true);
+    map m2 = map::from_sorted_unique(v.data(), v.data() + n);
+    check(same(m1, r) && same(m2, r), "from_sorted_unique: content");
+    map l1 = map::from_sorted_layout(v.data(), v.data() + n, true);
+    map::set_interleave_top(true);
+    map l2 = map::from_sorted_layout(v.data(), v.data() + n);
+    map::set_interleave_top(false);
+    check(same(l1, r) && same(l2, r), "from_sorted_layout: content");
+    size_t cnt = 0;
+    auto* root = l1.get_root();
+    size_t nodes = map::tree_ops::owned_size(root).first;
+    check(in_layout(root, cnt, root, root + nodes) && cnt == nodes,
+	  "from_sorted_layout: layout");
+    check(l1.aug_val() == m1.aug_val(), "from_sorted_layout: aug");
+    map m3 = map(v.data(), v.data() + n, true);
+    check(same(m3, r), "sorted constructor: content");
+    check(m1.aug_val() == m3.aug_val(), "from_sorted_unique: aug");
+    // sorted unique updates take the fast path, still ignoring absent keys
+    vector<elt> u;
+    for (size_t i = 0; i < n; i++) u.push_back(elt(2*i + 1, 1));
+    auto add = [] (int a, int b) { return a + b; };
+    map m5 = m1;
+    m5.multi_update(u.data(), u.data() + n, add, true);
+    check(same(m5, r), "multi_update: sorted absent keys ignored");
+    for (size_t i = 0; i < n; i++) u[i].first = 2*i;
+    m5.multi_update(u.data(), u.data() + n, add, true);
+    check(m5.size() == n && *m5.find(2) == 2 && *m5.find(2*(n-1)) == (int) n,
+	  "multi_update: sorted present keys updated");
+    // not unique, so falls back to the general construction
+    v[n/2].first = v[n/2 - 1].first;
+    map m4 = map::from_sorted_unique(v.data(), v.data() + n);
+    check(m4.size() == n - 1, "from_sorted_unique: duplicates");
+    map l4 = map::from_sorted_layout(v.data(), v.data() + n);
+    check(l4.size() == n - 1, "from_sorted_layout: duplicates");
+  }
+  check(map::num_used_nodes() == 0, "from_sorted_unique: used nodes at end");
+}
+
+void test_compact() {
+  int range = 200000;
+  ref_map r(range, -1);
+  {
+    map m;
+    for (int i = 0; i < 20000; i++) {
+      int k = rand() % range;
+      m.insert(elt(k, i)); r[k] = i;
+    }
+    map c = m;
+    c.compact();  // shares its root with m, so nothing moves
+    check(c.get_root() == m.get_root(), "compact: shared");
+    c.clear();
+
+    size_t used = map::num_used_nodes();
+    m.compact();
+    check(same(m, r), "compact: content");
+    size_t cnt = 0;
+    auto* root = m.get_root();
+    check(in_layout(root, cnt, root, root + m.size()) && cnt == m.size(),
+	  "compact: layout");
+    check(map::num_used_nodes() == used, "compact: used nodes");
+    map::release_free_nodes();
+    check(map::num_allocated_nodes() == used, "compact: released");
+    m.insert(elt(range, 0));
+    check(m.size() == cnt + 1, "compact: insert after release");
+
+    // nodes freed by all workers between two releases, enough to move
+    // lists from the workers' local lists to the global stacks
+    size_t k = 64;
+    vector<map> ms(k);
+    for (int round = 0; round < 2; round++) {
+      parallel_for (size_t i = 0; i < k; i++)
+	for (int j = 0; j < 4000; j++) ms[i].insert(elt(j, i));
+      map::release_free_nodes();
+      parallel_for (size_t i = 0; i < k; i++) ms[i].clear();
+      map::release_free_nodes();
+    }
+    check(map::num_used_nodes() == used + 1, "compact: frees between releases");
+    parallel_for (size_t i = 0; i < k; i++)
+      for (int j = 0; j < 4000; j++) ms[i].insert(elt(j, i));
+    bool ok = true;
+    for (size_t i = 0; i < k; i++) ok = ok && ms[i].size() == 4000;
+    check(ok, "compact: allocation after releases");
+  }
+  check(map::num_used_nodes() == 0, "compact: used nodes at end");
+}
+
+void test_huge_pages() {
+  for (auto k : {pbbs::transparent_huge_pages, pbbs::explicit_huge_pages}) {
+    map::set_page_kind(k);
+    int n = 200000;
+    vector<elt> v;
+    for (int i = 0; i < n; i++) v.push_back(elt(i, i));
+    map m1(v.data(), v.data() + n);
+    map m2 = map::from_sorted_layout(v.data(), v.data() + n, true);
+    check(m1.size() == (size_t) n && *m2.find(n-1) == n-1,
+	  "huge pages: content");
+    // the layout puts the root first in its own slab, which starts on a
+    // huge page
+    check((uintptr_t) m2.get_root() % pbbs::huge_page_size == 0,
+	  "huge pages: slab aligned");
+  }
+  map::set_page_kind(pbbs::normal_pages);
+  map::release_free_nodes();
+}
+
+void test_arena() {
+  size_t used = map::num_used_nodes();
+  {
+    map::arena a;
+    vector<elt> v;
+    for (int i = 0; i < 5000; i++) v.push_back(elt(i, i));
+    map m1(a), m2;
+    m1.multi_insert(v.data(), v.data() + v.size());
+    m2 = m1;
+    m2.insert(elt(-1, 0));
+    check(a.num_used_blocks() > 5000 && map::num_used_nodes() == used &&
+	  m2.get_arena() == &a, "arena: allocated in arena");
+    m1.insert(elt(-2, 0));
+    map m4 = m1.range(-2, 100);
+    check(map::num_used_nodes() == used && m4.get_arena() == &a,
+	  "arena: derived maps");
+    m4.clear();
+    // a map in the default pool
+    map d(v.data(), v.data() + v.size());
+    check(map::num_used_nodes() > used && d.get_arena() == NULL,
+	  "arena: default pool");
+    d.clear();
+    m1.clear();
+    check(map::num_used_nodes() == used, "arena: freed to owner");
+    check(m2.size() == 5001 && *m2.find(4999) == 4999, "arena: content");
+    size_t in_use = a.num_used_blocks();
+    a.release_free();
+    check(a.num_used_blocks() == in_use, "arena: release");
+    m2.abandon();
+
+    // maps of different arenas and of the default pool updated at once
+    // each allocate from their own
+    size_t k = 8;
+    vector<map::arena> as(k);
+    vector<map> ms;
+    for (size_t i = 0; i < k; i++) ms.push_back(map(as[i]));
+    parallel_for (size_t i = 0; i < 2*k; i++) {
+      map& t = i < k ? ms[i] : ms[i - k];
+      if (i < k)
+	for (int j = 0; j < 2000; j++) t.insert(elt(j, (int) i));
+      else {
+	map x;
+	for (int j = 0; j < 2000; j++) x.insert(elt(j, (int) i));
+      }
+    }
+    bool ok = map::num_used_nodes() == used;
+    for (size_t i = 0; i < k; i++)
+      ok = ok && as[i].num_used_blocks() == ms[i].size() &&
+	ms[i].size() == 2000;
+    check(ok, "arena: concurrent arenas");
+    for (size_t i = 0; i < k; i++) ms[i].abandon();
+
+    // abandoning destroys the entries, so nested maps are freed
+    using nested = tree_map<int, map>;
+    nested::arena na;
+    {
+      nested n(na);
+      for (int i = 0; i < 10; i++)
+	n.insert(make_pair(i, map(v.data(), v.data() + 100)));
+      check(map::num_used_nodes() > used, "arena: nested maps");
+      n.abandon();
+    }
+    check(map::num_used_nodes() == used, "arena: abandon destroys entries");
+
+    // abandoning still releases leaf blocks and evicted pages
+    pmap::arena pa;
+    page_store ps;
+    check(ps.open("/tmp/unit_tests_arena_pages.bin"), "arena: open store");
+    pmap m3(pa);
+    m3.multi_insert(v.data(), v.data() + v.size());
+    m3.evict(ps, 2);
+    check(*m3.find(10) == 10 && ps.num_faults() > 0 &&
+	  pa.num_used_blocks() > 0, "arena: evicted");
+    m3.abandon();
+    check(ps.release_resident() == 0, "arena: abandon drops pages");
+  }
+  check(map::num_used_nodes() == used, "arena: used nodes at end");
+}
+
+template<class T>
+bool same_shape(T* a, T* b) {
+  if (!a || !b) return a == b;
+  return a->get_key() == b->get_key() && 
+    same_shape(a->lc, b->lc) && same_shape(a->rc, b->rc);
+}
+
+void test_treap_shape() {
+  size_t n = 2000;
+  vector<elt> a;
+  for (size_t i = 0; i < n; i++) a.push_back(elt(rand() % (4*n), i));
+  treap t1(a.data(), a.data() + n);
+  treap t2;
+  for (size_t i = n; i > 0; i--) t2.insert(a[i-1]);
+  treap t3 = map_union(treap(a.data(), a.data() + n/2),
+		       treap(a.data() + n/2, a.data() + n));
+  check(same_shape(t1.get_root(), t2.get_root()), 
+	"treap: shape independent of insertion order");
+  check(same_shape(t1.get_root(), t3.get_root()), 
+	"treap: shape independent of union");
+  for (size_t i = 0; i < n; i += 2) t2.remove(a[i].first);
+  for (size_t i = 0; i < n; i += 2) t2.insert(a[i]);
+  check(same_shape(t1.get_root(), t2.get_root()), 
+	"treap: shape independent of deletions");
+}
+
+void test_unused_fields() {
+  using plain = tree_map<int, int, less<int>, wb_tree>;
+  check(!plain::node_type::has_aug && !plain::node_type::has_rank,
+	"fields: no aug or rank kept");
+  check(map::node_type::has_aug && map::node_type::has_rank,
+	"fields: aug and rank kept");
+  size_t n = 3000;
+  vector<elt> a;
+  for (size_t i = 0; i < n; i++) a.push_back(elt(rand() % (2*n), i));
+  plain p(a.data(), a.data() + n);
+  map m(a.data(), a.data() + n);
+  check(p.size() == m.size(), "fields: size");
+  for (size_t i = 0; i < n; i += 7) {
+    int k = a[i].first;
+    check(p.rank(k) == m.rank(k), "fields: rank");
+    check(p.select(i % p.size()).first == m.select(i % m.size()).first,
+	  "fields: select");
+  }
+  for (size_t i = 0; i < n; i += 3) p.remove(a[i].first), m.remove(a[i].first);
+  check(p.size() == m.size(), "fields: size after removes");
+  check(p.aug_val() == false, "fields: empty aug");
+}
+
+// nodes without sizes, augmented values or reference counts
+struct lean_policy : default_node_policy {
+  static constexpr bool order_statistics = false;
+  static constexpr bool augmentation = false;
+  static constexpr bool persistence = false;
+};
+
+struct unshared_policy : default_node_policy {
+  static constexpr bool persistence = false;
+};
+
+using lean = augmented_map<int, int, aug, less<int>, avl_tree, lean_policy>;
+using unshared = augmented_map<int, int, aug, less<int>, avl_tree,
+			       unshared_policy>;
+
+template<class M>
+vector<elt> contents(const M& m) {
+  vector<elt> e;
+  m.content(back_inserter(e));
+  return e;
+}
+
+// M must agree with map on everything it supports, and free all its
+// nodes when its maps are gone
+template<class M>
+void check_policy(const string& name) {
+  size_t n = 5000;
+  vector<elt> a, b;
+  // distinct keys, as which of equal keys a build keeps may vary
+  for (size_t i = 0; i < n; i++) {
+    a.push_back(elt((i * 7919) % (4*n), i));
+    b.push_back(elt((i * 7907 + 13) % (4*n), i));
+  }
+  size_t used = M::num_used_nodes();
+  {
+    M ma(a.data(), a.data() + n), mb(b.data(), b.data() + n);
+    map ra(a.data(), a.data() + n), rb(b.data(), b.data() + n);
+    check(ma.size() == ra.size() && contents(ma) == contents(ra),
+	  name + ": build");
+    check(contents(map_union(ma, mb)) == contents(map_union(ra, rb)),
+	  name + ": union");
+    check(contents(map_intersect(ma, mb)) == contents(map_intersect(ra, rb)),
+	  name + ": intersect");
+    check(contents(map_difference(ma, mb)) == contents(map_difference(ra, rb)),
+	  name + ": difference");
+
+    M mc = ma;
+    for (size_t i = 0; i < n; i += 2) mc.remove(a[i].first);
+    check(contents(ma) == contents(ra), name + ": copy is separate");
+    check(mc.size() < ma.size(), name + ": size of copy");
+
+    M mr = ma.range(n, 2*n);
+    check(contents(mr) == contents(ra.range(n, 2*n)), name + ": range");
+    auto sp = ma.split(a[0].first);
+    check(sp.first.size() + sp.second.size() + 1 == ma.size(),
+	  name + ": split");
+
+    vector<elt> e(ma.size());
+    ma.entries(e.data());
+    check(e == contents(ra), name + ": entries");
+    for (size_t i = 0; i < n; i += 5)
+      check(ma.contains(a[i].first) && !ma.contains(-1 - (int) i),
+	    name + ": find");
+
+    auto even = [] (elt x) { return (x.first & 1) == 0; };
+    ma.filter(even); ra.filter(even);
+    for (size_t i = 0; i < n; i += 3) ma.remove(b[i].first), ra.remove(b[i].first);
+    check(ma.size() == ra.size() && contents(ma) == contents(ra),
+	  name + ": filter and remove");
+  }
+  check(M::num_used_nodes() == used, name + ": nodes freed");
+}
+
+void test_node_policy() {
+  using lean_set = augmented_map<int, nill, noop<int,nill>, less<int>,
+				 avl_tree, lean_policy>;
+  check(sizeof(lean_set::node_type) < sizeof(tree_set<int>::node_type),
+	"policy: smaller set nodes");
+  check(sizeof(lean::node_type) < sizeof(tree_map<int,int>::node_type),
+	"policy: smaller map nodes");
+  using unshared_plain = augmented_map<int, int, noop<int,int>, less<int>,
+				       avl_tree, unshared_policy>;
+  check(sizeof(unshared_plain::node_type) < sizeof(tree_map<int,int>::node_type),
+	"policy: smaller nodes without reference counts");
+  check_policy<lean>("policy (lean)");
+  check_policy<unshared>("policy (unshared)");
+
+  size_t n = 1000;
+  vector<elt> a;
+  for (size_t i = 0; i < n; i++) a.push_back(elt(i, i));
+  unshared u(a.data(), a.data() + n);
+  map m(a.data(), a.data() + n);
+  check(u.aug_val() == m.aug_val() && u.aug_left(n/2) == m.aug_left(n/2),
+	"policy: aug without reference counts");
+}
+
+void test_save_load() {
+  size_t n = 100000;
+  vector<elt> a;
+  for (size_t i = 0; i < n; i++) a.push_back(elt(rand() % (2*n), i));
+  map m(a.data(), a.data() + n);
+  string path = "/tmp/unit_tests_map.bin";
+  check(m.save(path), "save: write");
+  map l;
+  check(l.load(path), "load: read");
+  check(l.size() == m.size(), "load: size");
+  check(l == m, "load: entries");
+  check(abs(l.aug_val() - m.aug_val()) <= 1e-4 * m.aug_val(), "load: aug");
+  for (size_t i = 0; i < n; i += 97)
+    check(*l.find(a[i].first) == *m.find(a[i].first), "load: values");
+
+  map e;
+  check(e.save(path) && l.load(path) && l.size() == 0, "load: empty map");
+  check(!l.load("/nonexistent/map.bin"), "load: missing file");
+  treap t;
+  check(m.save(path) && t.load(path) && t.size() == m.size(),
+	"load: other balance scheme");
+  tree_map<int, long> w;
+  check(!w.load(path) && w.size() == 0, "load: wrong entry type");
+  unlink(path.c_str());
+}
+
+void test_map_image() {
+  size_t n = 50000;
+  vector<elt> a;
+  for (size_t i = 0; i < n; i++) a.push_back(elt(rand() % (4*n), i));
+  map m(a.data(), a.data() + n);
+  string path = "/tmp/unit_tests_map.img";
+  check(map_image<map>::write(m, path), "image: write");
+  map_image<map> img;
+  check(img.open(path), "image: open");
+  check(img.size() == m.size(), "image: size");
+  check(abs(img.aug_val() - m.aug_val()) <= 1e-4 * m.aug_val(), "image: aug");
+  for (size_t i = 0; i < 4*n; i += 13) {
+    int k = i;
+    check(img.contains(k) == m.contains(k), "image: contains");
+    if (m.contains(k)) check(*img.find(k) == *m.find(k), "image: find");
+    check(img.rank(k) == m.rank(k), "image: rank");
+    float d = img.aug_left(k) - m.aug_left(k);
+    check(abs(d) <= 1e-4 * m.aug_val(), "image: aug_left");
+    d = img.aug_right(k) - m.aug_right(k);
+    check(abs(d) <= 1e-4 * m.aug_val(), "image: aug_right");
+    d = img.aug_range(k, k + n/3) - m.aug_range(k, k + n/3);
+    check(abs(d) <= 1e-4 * m.aug_val(), "image: aug_range");
+  }
+  for (size_t i = 0; i < m.size(); i += 7)
+    check(img.select(i) == m.select(i), "image: select");
+
+  map_image<map>::cursor c = img.get_cursor();
+  map::cursor mc = m.get_cursor();
+  size_t cnt = 0;
+  for (c.seek_first(), mc.seek_first(); c.valid(); c.next(), mc.next(), cnt++)
+    check(mc.valid() && c.get_entry() == mc.get_entry(), "image: cursor");
+  check(cnt == m.size(), "image: cursor count");
+  for (c.seek_last(), cnt = 0; c.valid(); c.prev()) cnt++;
+  check(cnt == m.size(), "image: cursor backwards");
+  c.seek(n);
+  mc.seek(n);
+  check(c.valid() && c.get_key() == mc.get_key(), "image: cursor seek");
+  c.seek_rank(m.size() / 2);
+  check(c.get_entry() == m.select(m.size() / 2), "image: cursor seek_rank");
+
+  map_image<treap> other;
+  check(other.open(path), "image: same entry types");
+  map_image<tree_map<int, long> > wrong;
+  check(!wrong.open(path), "image: wrong type");
+  img.close();
+  map e;
+  check(map_image<map>::write(e, path) && img.open(path) && img.size() == 0 &&
+	img.rank(3) == 0 && !img.contains(3), "image: empty map");
+  c.seek_first();
+  check(!c.valid(), "image: empty cursor");
+  unlink(path.c_str());
+}
+
+// the number of evicted blocks in t, and the most entries in one
+template<class T>
+void paged_blocks(T* t, size_t& cnt, size_t& most) {
+  if (!t) return;
+  if (t->is_block) {
+    if (T::block_type::is_paged(t->block)) {
+      cnt++;
+      most = max(most, (size_t) t->node_cnt);
+    }
+    return;
+  }
+  paged_blocks(t->lc, cnt, most);
+  paged_blocks(t->rc, cnt, most);
+}
+
+void test_evict() {
+  size_t n = 100000;
+  vector<elt> a;
+  for (size_t i = 0; i < n; i++) a.push_back(elt(rand() % (4*n), i));
+  pmap m(a.data(), a.data() + n);
+  pmap old = m;
+  page_store s;
+  check(s.open("/tmp/unit_tests_pages.bin"), "evict: open store");
+  pmap e = m;
+  e.evict(s, 4);
+  check(s.num_bytes() > 0 && s.num_faults() == 0, "evict: written");
+  check(e.size() == m.size() && e.aug_val() == m.aug_val(), "evict: size and aug");
+  size_t pages = 0, most = 0;
+  paged_blocks(e.get_root(), pages, most);
+  check(pages > 16 && most <= 64, "evict: pages of at most 64 entries");
+  pmap::node_type* r = e.get_root();
+  check(e.aug_left(r->get_key()) == m.aug_left(r->get_key()) &&
+	e.aug_range(r->lc->get_key(), r->rc->get_key()) ==
+	m.aug_range(r->lc->get_key(), r->rc->get_key()) &&
+	s.num_faults() == 0, "evict: aug at the boundary reads nothing");
+  for (size_t i = 0; i < n; i += 11) {
+    int k = a[i].first;
+    check(e.contains(k) && *e.find(k) == *m.find(k), "evict: find");
+    check(e.rank(k) == m.rank(k), "evict: rank");
+  }
+  check(s.num_faults() > 0 && s.num_faults() <= pages, "evict: read back once");
+  check(s.release_resident() == s.num_faults(), "evict: release");
+  // a find in the evicted part reads back one page, and scans no more
+  // entries than there are in a page
+  size_t faults = s.num_faults(), bytes = s.num_bytes_read();
+  check(*e.find(a[n/3].first) == *m.find(a[n/3].first) &&
+	s.num_faults() == faults + 1 &&
+	s.num_bytes_read() - bytes <= 64 * sizeof(elt), "evict: find reads a page");
+  check(e.select(n/2) == m.select(n/2), "evict: select after release");
+
+  // updates copy what they touch out of the evicted blocks
+  vector<elt> b;
+  for (size_t i = 0; i < n/10; i++) b.push_back(elt(rand() % (4*n), -1));
+  e.multi_insert(b.data(), b.data() + b.size());
+  m.multi_insert(b.data(), b.data() + b.size());
+  check(e == m && e.size() == m.size(), "evict: insert");
+  e = map_difference(e, old);
+  m = map_difference(m, old);
+  check(e == m && e.size() == m.size(), "evict: difference");
+  vector<elt> eo(old.size());
+  old.entries(eo.data());
+  check(is_sorted(eo.begin(), eo.end()) && old.size() <= n,
+	"evict: other versions unchanged");
+  e.clear();
+  m.clear();
+}
+
+void test_durable_map() {
+  string path = "/tmp/unit_tests_durable";
+  unlink((path + ".ckpt").c_str());
+  unlink((path + ".log").c_str());
+  unlink((path + ".log.old").c_str());
+  {
+    durable_map<map> d;
+    check(d.open(path) && d.snapshot().size() == 0, "durable: create");
+    for (int i = 0; i < 100; i++) d.insert(elt(i, i));
+    check(d.checkpoint(), "durable: checkpoint");
+    d.insert(elt(5, 50));
+    d.insert_if_absent(elt(6, 60));
+    d.remove(7);
+    // dropped without a checkpoint, as in a crash
+  }
+  {
+    durable_map<map> d;
+    check(d.open(path), "durable: recover");
+    map m = d.snapshot();
+    check(m.size() == 99 && *m.find(5) == 50 && *m.find(6) == 6 &&
+	  !m.contains(7), "durable: checkpoint and log replayed");
+    d.start_checkpoints(std::chrono::milliseconds(5));
+    for (int i = 100; i < 200; i++) d.insert(elt(i, i));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    for (int i = 0; i < 50; i++) d.remove(i);
+    d.stop_checkpoints();
+  }
+  // a group cut short by a crash is dropped
+  FILE* f = fopen((path + ".log").c_str(), "a");
+  fwrite("torn", 1, 4, f);
+  fclose(f);
+  {
+    durable_map<map> d;
+    check(d.open(path), "durable: recover torn log");
+    map m = d.snapshot();
+    check(m.size() == 150 && !m.contains(49) && *m.find(150) == 150,
+	  "durable: after background checkpoints");
+  }
+  // replaying updates already in the checkpoint changes nothing
+  {
+    durable_map<map> d;
+    check(d.open(path), "durable: reopen");
+    d.insert(elt(200, 200));
+    d.remove(150);
+  }
+  rename((path + ".log").c_str(), (path + ".log.old").c_str());
+  {
+    durable_map<map> d;
+    check(d.open(path), "durable: recover old log");
+    d.insert(elt(201, 201));
+  }
+  {
+    durable_map<map> d;
+    check(d.open(path), "durable: recover both");
+    map m = d.snapshot();
+    check(m.size() == 151 && m.contains(200) && m.contains(201) &&
+	  !m.contains(150), "durable: old log replayed");
+  }
+  unlink((path + ".ckpt").c_str());
+  unlink((path + ".log").c_str());
+}
+
 void test_index() {
   // Test index
   using map_elt = inv_index::map_elt;
@@ -265,6 +1274,24 @@ void test_map_reserve_finish() {
 int main() {
   test_map();
   test_map_more();
+  test_map_blocks();
+  test_balance_scheme<map>("avl");
+  test_balance_scheme<augmented_map<int, int, aug, less<int>, wb_tree> >("wb");
+  test_balance_scheme<treap>("treap", 4);
+  test_treap_shape();
+  test_shared_versions();
+  test_versioned_map();
+  test_map_builder();
+  test_from_sorted_unique();
+  test_compact();
+  test_arena();
+  test_huge_pages();
+  test_unused_fields();
+  test_node_policy();
+  test_save_load();
+  test_map_image();
+  test_evict();
+  test_durable_map();
   test_index();
   check(map::num_used_nodes() == 0, "used nodes at end");
   test_map_reserve_finish();